@@ -9,14 +9,50 @@
  */
 
 #ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/kernel.h> // trace_printk
+#include <linux/slab.h>
 #include <linux/string.h>
 #else
+#include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
 #endif
 
 #include "aesd-circular-buffer.h"
 
+/**
+ * Trace points. Off by default: the arguments aren't even evaluated.
+ */
+#ifndef AESD_CIRCULAR_BUFFER_TRACE
+#define AESD_CB_TRACE(event, buffer, index, value) do { } while(0)
+#elif defined(__KERNEL__)
+#define AESD_CB_TRACE(event, buffer, index, value) \
+    trace_printk("aesd_circular_buffer event=%d buffer=%p index=%u value=%zu\n", \
+                 (event), (const void *) (buffer), (unsigned) (index), (size_t) (value))
+#else
+void (*aesd_circular_buffer_trace_hook)(const struct aesd_circular_buffer_trace *trace);
+
+#define AESD_CB_TRACE(event_, buffer_, index_, value_) \
+    do { \
+        if(aesd_circular_buffer_trace_hook != NULL){ \
+            struct aesd_circular_buffer_trace trace_ = {.event = (event_), .buffer = (buffer_), \
+                                                        .index = (index_), .value = (value_)}; \
+            aesd_circular_buffer_trace_hook(&trace_); \
+        } \
+    } while(0)
+#endif
+
+/**
+ * @return the number of entries held in @param buffer, oldest first starting at out_offs
+ */
+static unsigned long entriesHeld(const struct aesd_circular_buffer *buffer)
+{
+    if(buffer->full){
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    return aesd_circular_buffer_wrap(buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs);
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -30,45 +66,36 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    /**
-    * TODO: implement per description
-    */
-
     if(buffer == NULL || entry_offset_byte_rtn == NULL){
-        printf("Null addresses passed into find_entry_offet_for_fpos. Returning\n");
+        AESD_CB_TRACE(AESD_CB_TRACE_NULL_ARG, buffer, 0, 0);
         return NULL;
     }
 
-    // First we need to find the entry who has this character offset.
-    int numCharsInBuffer = 0;
-    int prevNumCharsInBuffer = 0;
-    int entryIndex = buffer->out_offs;
-    int entriesProcessed = 0;
-    while(entriesProcessed < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
-        prevNumCharsInBuffer = numCharsInBuffer;
-        numCharsInBuffer += buffer->entry[entryIndex].size;
-        printf("After considering entry %d, total chars is %d\n", entryIndex, numCharsInBuffer);
-        if(numCharsInBuffer > char_offset){
-            // Buffer now contains the char offset, and entryIndex holds the entry that just got us there.
-            printf("Char offset should be in entry indexed %d\n", entryIndex);
-            break;
-        }
-
-        entriesProcessed += 1;
-        entryIndex += 1;
-        if(entryIndex == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
-            entryIndex = 0;
-        }
+    // Everything is measured from the start of the oldest entry, so wrapped positions compare correctly
+    size_t base = buffer->entry_start[buffer->out_offs];
+    if(char_offset >= buffer->end_pos - base){
+        // If this is hit then the char offset does not map to an entry.
+        AESD_CB_TRACE(AESD_CB_TRACE_FIND_MISS, buffer, 0, char_offset);
+        return NULL;
     }
 
-    if(numCharsInBuffer - 1 < char_offset){
-        // If this is hit then the char offset does not map to an entry. 
-        printf("Char offset not found in buffer. Returning\n");
-        return NULL;
+    // Binary search for the last entry starting at or before char_offset. Empty entries share their
+    // start with the next one, so the last such entry is always the one holding the byte.
+    uint32_t low = 0;
+    uint32_t high = entriesHeld(buffer) - 1;
+    while(low < high){
+        uint32_t mid = low + (high - low + 1) / 2;
+        uint32_t midIndex = aesd_circular_buffer_wrap(buffer->out_offs + mid);
+        if(buffer->entry_start[midIndex] - base <= char_offset){
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
     }
 
-    // We have total chars and the index of the start of the string of interest
-    *entry_offset_byte_rtn = char_offset - prevNumCharsInBuffer; 
+    uint32_t entryIndex = aesd_circular_buffer_wrap(buffer->out_offs + low);
+    AESD_CB_TRACE(AESD_CB_TRACE_FIND, buffer, entryIndex, char_offset);
+    *entry_offset_byte_rtn = char_offset - (buffer->entry_start[entryIndex] - base);
 
     return &buffer->entry[entryIndex];
 }
@@ -82,46 +109,248 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 */
 void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-    /**
-    * TODO: implement per description
-    */
-    static int hasBufferBeenFilled = 0;
-
     if(buffer == NULL || add_entry == NULL){
-        printf("Null addresses passed into add_entry. Returning\n");
+        AESD_CB_TRACE(AESD_CB_TRACE_NULL_ARG, buffer, 0, 0);
         return;
     }
 
-
-    // Insert buffer entry
+    // Insert buffer entry. Its start position replaces the evicted entry's, which is all eviction needs.
     buffer->entry[buffer->in_offs] = *add_entry;
-    printf("Wrote entry to index %d w/ str: %s\n", buffer->in_offs, add_entry->buffptr);
+    buffer->entry_start[buffer->in_offs] = buffer->end_pos;
+    buffer->end_pos += add_entry->size;
+    buffer->generation++;
+    AESD_CB_TRACE(AESD_CB_TRACE_ADD, buffer, buffer->in_offs, add_entry->size);
 
-    // Check if we wrote to end of list
-    if(hasBufferBeenFilled && buffer->out_offs == buffer->in_offs){
+    if(buffer->full){
         // We just overwrote oldest data, increment both out and in then
-        buffer->out_offs += 1;
-        if(buffer->out_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
-            buffer->out_offs = 0;
+        AESD_CB_TRACE(AESD_CB_TRACE_EVICT, buffer, buffer->out_offs, 0);
+        buffer->out_offs = aesd_circular_buffer_wrap(buffer->out_offs + 1);
+    }
+
+    // Increment our index tracker; catching up with out_offs means every entry is in use
+    buffer->in_offs = aesd_circular_buffer_wrap(buffer->in_offs + 1);
+    buffer->full = buffer->in_offs == buffer->out_offs;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct
+*/
+void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+{
+    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+}
+
+/**
+ * Positions @param cursor at the first byte of the oldest entry in @param buffer
+ * Any necessary locking must be performed by caller, here and in the other cursor functions.
+ */
+void aesd_circular_buffer_cursor_init(const struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_cursor *cursor)
+{
+    cursor->generation = buffer->generation - entriesHeld(buffer);
+    cursor->entry_offs = buffer->out_offs;
+    cursor->entry_offset_byte = 0;
+}
+
+/**
+ * Positions @param cursor at @param char_offset, counted as in aesd_circular_buffer_find_entry_offset_for_fpos()
+ * @return true on success, false if char_offset is beyond the data in @param buffer (the cursor is unchanged).
+ *      An offset just past the last byte is valid: the cursor then waits for the next entry added.
+ */
+bool aesd_circular_buffer_cursor_seek(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_cursor *cursor, size_t char_offset)
+{
+    size_t entryOffset;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset,
+                                                                                      &entryOffset);
+    if(entry == NULL){
+        if(char_offset != buffer->end_pos - buffer->entry_start[buffer->out_offs]){
+            return false;
         }
+        cursor->generation = buffer->generation;
+        cursor->entry_offs = buffer->in_offs;
+        cursor->entry_offset_byte = 0;
+        return true;
     }
 
-    // Increment our index tracker and wrap if needed
-    buffer->in_offs += 1;
-    if(buffer->in_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
-        // Buffer is at max, reset to zero
-        buffer->in_offs = 0;
-        hasBufferBeenFilled = 1;
+    uint32_t index = entry - buffer->entry;
+    // Entries between the oldest and this one
+    uint32_t age = aesd_circular_buffer_wrap(index + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs);
+    cursor->generation = buffer->generation - entriesHeld(buffer) + age;
+    cursor->entry_offs = index;
+    cursor->entry_offset_byte = entryOffset;
+    return true;
+}
+
+/**
+ * @return true if the entry under @param cursor has been evicted from @param buffer since the cursor was
+ *      positioned. The cursor's position is lost; seek it again (e.g. to the oldest data) to continue.
+ */
+bool aesd_circular_buffer_cursor_overwritten(const struct aesd_circular_buffer *buffer,
+            const struct aesd_circular_buffer_cursor *cursor)
+{
+    return buffer->generation - cursor->generation > entriesHeld(buffer);
+}
+
+/**
+ * Moves @param cursor off the ends of entries it has read completely, skipping empty entries
+ */
+static void cursorSettle(const struct aesd_circular_buffer *buffer, struct aesd_circular_buffer_cursor *cursor)
+{
+    while(cursor->generation != buffer->generation &&
+          cursor->entry_offset_byte >= buffer->entry[cursor->entry_offs].size){
+        cursor->entry_offset_byte -= buffer->entry[cursor->entry_offs].size;
+        cursor->generation++;
+        cursor->entry_offs = aesd_circular_buffer_wrap(cursor->entry_offs + 1);
     }
+}
 
-    printf("After inserting, in_offs=%d | out_offs=%d\n", buffer->in_offs, buffer->out_offs);
+/**
+ * @param entry_offset_byte_rtn is set to the byte under @param cursor within the returned entry
+ * @return the entry under @param cursor, or NULL if the cursor is past all data in @param buffer
+ *      or was overwritten (see aesd_circular_buffer_cursor_overwritten()).
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_cursor_entry(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_cursor *cursor, size_t *entry_offset_byte_rtn)
+{
+    if(aesd_circular_buffer_cursor_overwritten(buffer, cursor)){
+        AESD_CB_TRACE(AESD_CB_TRACE_CURSOR_OVERWRITTEN, buffer, cursor->entry_offs, 0);
+        return NULL;
+    }
+    cursorSettle(buffer, cursor);
+    if(cursor->generation == buffer->generation){
+        return NULL;
+    }
+    *entry_offset_byte_rtn = cursor->entry_offset_byte;
+    return &buffer->entry[cursor->entry_offs];
+}
 
+/**
+ * Moves @param cursor forward @param bytes, which may span entries but not go past the last byte added.
+ * Costs O(1) per entry passed.
+ */
+void aesd_circular_buffer_cursor_advance(const struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_cursor *cursor, size_t bytes)
+{
+    if(aesd_circular_buffer_cursor_overwritten(buffer, cursor)){
+        return;
+    }
+    cursor->entry_offset_byte += bytes;
+    cursorSettle(buffer, cursor);
 }
 
+#ifndef __KERNEL__
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+ * A run of buffers allocated together; the slab frees them all at once when destroyed
+ */
+struct aesd_circular_buffer_slab_chunk
+{
+    struct aesd_circular_buffer_slab_chunk *next;
+    struct aesd_circular_buffer buffers[];
+};
+
+/**
+ * What a free buffer holds while it waits on the slab's free list
+ */
+struct aesd_circular_buffer_slab_free
+{
+    struct aesd_circular_buffer_slab_free *next;
+};
+#endif
+
+/**
+* Prepares @param slab to hand out buffers
+* @return 0 on success, nonzero on failure.
 */
-void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+int aesd_circular_buffer_slab_init(struct aesd_circular_buffer_slab *slab)
 {
-    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+#ifdef __KERNEL__
+    slab->cache = kmem_cache_create("aesd_circular_buffer", sizeof(struct aesd_circular_buffer), 0, 0, NULL);
+    return slab->cache == NULL ? -ENOMEM : 0;
+#else
+    memset(slab, 0, sizeof(*slab));
+    slab->chunk_buffers = AESD_CIRCULAR_BUFFER_SLAB_CHUNK_BYTES / sizeof(struct aesd_circular_buffer);
+    if(slab->chunk_buffers == 0){
+        slab->chunk_buffers = 1;
+    }
+    return pthread_mutex_init(&slab->lock, NULL);
+#endif
+}
+
+/**
+* Releases the memory behind @param slab. In the kernel every buffer allocated from it must have been freed;
+* in userspace buffers still allocated are released with the rest and must not be used afterwards.
+*/
+void aesd_circular_buffer_slab_destroy(struct aesd_circular_buffer_slab *slab)
+{
+#ifdef __KERNEL__
+    kmem_cache_destroy(slab->cache);
+    slab->cache = NULL;
+#else
+    struct aesd_circular_buffer_slab_chunk *chunk = slab->chunks;
+    while(chunk != NULL){
+        struct aesd_circular_buffer_slab_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    slab->chunks = NULL;
+    slab->free_list = NULL;
+    pthread_mutex_destroy(&slab->lock);
+#endif
+}
+
+/**
+* @return a buffer from @param slab, initialized as by aesd_circular_buffer_init(), or NULL if out of memory.
+*/
+struct aesd_circular_buffer *aesd_circular_buffer_alloc(struct aesd_circular_buffer_slab *slab)
+{
+    struct aesd_circular_buffer *buffer;
+#ifdef __KERNEL__
+    buffer = kmem_cache_alloc(slab->cache, GFP_KERNEL);
+    if(buffer == NULL){
+        return NULL;
+    }
+#else
+    pthread_mutex_lock(&slab->lock);
+    if(slab->free_list == NULL){
+        // Carve a new chunk into free buffers, in address order
+        struct aesd_circular_buffer_slab_chunk *chunk = malloc(sizeof(*chunk) +
+                                                              slab->chunk_buffers * sizeof(struct aesd_circular_buffer));
+        if(chunk == NULL){
+            pthread_mutex_unlock(&slab->lock);
+            return NULL;
+        }
+        chunk->next = slab->chunks;
+        slab->chunks = chunk;
+        for(size_t i = slab->chunk_buffers; i > 0; i--){
+            struct aesd_circular_buffer_slab_free *node = (struct aesd_circular_buffer_slab_free *) &chunk->buffers[i - 1];
+            node->next = slab->free_list;
+            slab->free_list = node;
+        }
+    }
+    buffer = (struct aesd_circular_buffer *) slab->free_list;
+    slab->free_list = slab->free_list->next;
+    pthread_mutex_unlock(&slab->lock);
+#endif
+    aesd_circular_buffer_init(buffer);
+    return buffer;
+}
+
+/**
+* Returns @param buffer to @param slab. Freeing what its entries point to is up to the caller.
+*/
+void aesd_circular_buffer_free(struct aesd_circular_buffer_slab *slab, struct aesd_circular_buffer *buffer)
+{
+    if(buffer == NULL){
+        return;
+    }
+#ifdef __KERNEL__
+    kmem_cache_free(slab->cache, buffer);
+#else
+    struct aesd_circular_buffer_slab_free *node = (struct aesd_circular_buffer_slab_free *) buffer;
+    pthread_mutex_lock(&slab->lock);
+    node->next = slab->free_list;
+    slab->free_list = node;
+    pthread_mutex_unlock(&slab->lock);
+#endif
 }
@@ -14,9 +14,23 @@
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
+#include <pthread.h>
 #endif
 
+/**
+ * Entries a buffer holds. Override at build time (-DAESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED=n) for deeper
+ * history; a power of two lets indices wrap with a mask instead of a division.
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
+
+#define AESDCHAR_CAPACITY_IS_POWER_OF_2 \
+    ((AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED & (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1)) == 0)
+
+_Static_assert(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED > 0 &&
+               AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED <= 0x80000000u,
+               "circular buffer capacity must fit the uint32_t offsets");
 
 struct aesd_buffer_entry
 {
@@ -40,17 +54,94 @@ struct aesd_circular_buffer
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Position of the first byte of each entry in the stream of everything ever added to the buffer.
+     * Only differences between these are meaningful; they wrap with size_t.
+     */
+    size_t entry_start[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    /**
+     * Stream position just past the most recently added entry
+     */
+    size_t end_pos;
+    /**
+     * Number of entries ever added to the buffer, so also the sequence number the next entry gets
+     */
+    unsigned long generation;
+};
+
+/**
+ * A position in a buffer that a sequential reader moves forward through, so each chunk read
+ * doesn't search from the oldest entry again
+ */
+struct aesd_circular_buffer_cursor
+{
+    /**
+     * Sequence number (see aesd_circular_buffer.generation) of the entry the cursor is in.
+     * Equal to the buffer's generation when the cursor is past everything added so far.
+     */
+    unsigned long generation;
+    /**
+     * The location in the entry structure of that entry
+     */
+    uint32_t entry_offs;
+    /**
+     * The byte within that entry
+     */
+    size_t entry_offset_byte;
+};
+
+/**
+ * Events reported when built with -DAESD_CIRCULAR_BUFFER_TRACE. Without it nothing is traced and the trace
+ * points compile to nothing, arguments included.
+ */
+enum aesd_circular_buffer_trace_event
+{
+    AESD_CB_TRACE_NULL_ARG,           // A function was called with a NULL pointer and did nothing
+    AESD_CB_TRACE_ADD,                // index: slot written, value: entry size
+    AESD_CB_TRACE_EVICT,              // index: slot of the oldest entry, just overwritten
+    AESD_CB_TRACE_FIND,               // index: slot found, value: char_offset searched for
+    AESD_CB_TRACE_FIND_MISS,          // value: char_offset searched for, beyond the data held
+    AESD_CB_TRACE_CURSOR_OVERWRITTEN, // index: slot the cursor was in
+};
+
+#ifdef AESD_CIRCULAR_BUFFER_TRACE
+struct aesd_circular_buffer_trace
+{
+    enum aesd_circular_buffer_trace_event event;
+    const struct aesd_circular_buffer *buffer;
+    uint32_t index;
+    size_t value;
 };
 
+#ifndef __KERNEL__
+/**
+ * Called synchronously for each event when set; in the kernel events go to the ftrace buffer instead
+ */
+extern void (*aesd_circular_buffer_trace_hook)(const struct aesd_circular_buffer_trace *trace);
+#endif
+#endif
+
+/**
+ * @return @param index (at most twice the capacity) wrapped into the entry array. Folds to a mask for
+ *      power of two capacities and to a multiply otherwise; neither branches.
+ */
+static inline uint32_t aesd_circular_buffer_wrap(uint32_t index)
+{
+    if(AESDCHAR_CAPACITY_IS_POWER_OF_2){
+        return index & (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1);
+    }
+    return index % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
@@ -58,14 +149,65 @@ extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern void aesd_circular_buffer_cursor_init(const struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_cursor *cursor);
+
+extern bool aesd_circular_buffer_cursor_seek(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_cursor *cursor, size_t char_offset);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_cursor_entry(struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_cursor *cursor, size_t *entry_offset_byte_rtn);
+
+extern void aesd_circular_buffer_cursor_advance(const struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_cursor *cursor, size_t bytes);
+
+extern bool aesd_circular_buffer_cursor_overwritten(const struct aesd_circular_buffer *buffer,
+            const struct aesd_circular_buffer_cursor *cursor);
+
+/**
+ * Hands out many buffers cheaply: a kmem_cache in the kernel, and in userspace chunks of about
+ * AESD_CIRCULAR_BUFFER_SLAB_CHUNK_BYTES carved into buffers and recycled through a free list.
+ * Allocating and freeing are thread safe; using each buffer still needs the caller's locking.
+ */
+#define AESD_CIRCULAR_BUFFER_SLAB_CHUNK_BYTES (64 * 1024)
+
+struct aesd_circular_buffer_slab
+{
+#ifdef __KERNEL__
+    struct kmem_cache *cache;
+#else
+    pthread_mutex_t lock;
+    /**
+     * Every chunk allocated, so destroying the slab can free them
+     */
+    struct aesd_circular_buffer_slab_chunk *chunks;
+    /**
+     * Buffers not handed out, linked through their own memory
+     */
+    struct aesd_circular_buffer_slab_free *free_list;
+    /**
+     * Buffers carved from each chunk
+     */
+    size_t chunk_buffers;
+#endif
+};
+
+extern int aesd_circular_buffer_slab_init(struct aesd_circular_buffer_slab *slab);
+
+extern void aesd_circular_buffer_slab_destroy(struct aesd_circular_buffer_slab *slab);
+
+extern struct aesd_circular_buffer *aesd_circular_buffer_alloc(struct aesd_circular_buffer_slab *slab);
+
+extern void aesd_circular_buffer_free(struct aesd_circular_buffer_slab *slab, struct aesd_circular_buffer *buffer);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -0,0 +1,159 @@
+/**
+ * @file circular_buffer_bench.c
+ * @brief Benchmark for many independent circular buffers driven concurrently, one set per thread,
+ *          all allocated from one shared slab.
+ *
+ * Build with
+ *     gcc -O2 -pthread circular_buffer_bench.c aesd-circular-buffer.c -o circular_buffer_bench
+ * and run ./circular_buffer_bench [threads] [buffers_per_thread] [entries_per_buffer].
+ *
+ * Each thread allocates its buffers, then adds entries to them round robin, checking after every add that
+ * a lookup of the last byte finds the entry just added. A buffer that shared wrap state with another
+ * would fail that check once either one wrapped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "aesd-circular-buffer.h"
+
+#define BENCH_PAYLOADS (16)
+
+typedef struct bench_thread_s {
+    pthread_t thread;
+    struct aesd_circular_buffer_slab *slab;
+    unsigned buffers;
+    unsigned entries;
+    uint64_t allocNs;
+    uint64_t addNs;
+    uint64_t freeNs;
+    unsigned long failures;
+} bench_thread_t;
+
+static char payloads[BENCH_PAYLOADS][32];
+static size_t payloadSizes[BENCH_PAYLOADS];
+
+static uint64_t monotonicNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void *benchThread(void *arg)
+{
+    bench_thread_t *bench = arg;
+    struct aesd_circular_buffer **buffers = calloc(bench->buffers, sizeof(*buffers));
+    if(buffers == NULL){
+        perror("calloc");
+        bench->failures++;
+        return NULL;
+    }
+
+    uint64_t start = monotonicNs();
+    for(unsigned i = 0; i < bench->buffers; i++){
+        buffers[i] = aesd_circular_buffer_alloc(bench->slab);
+        if(buffers[i] == NULL){
+            perror("aesd_circular_buffer_alloc");
+            bench->failures++;
+            bench->buffers = i;
+            break;
+        }
+    }
+    bench->allocNs = monotonicNs() - start;
+
+    start = monotonicNs();
+    for(unsigned round = 0; round < bench->entries; round++){
+        for(unsigned i = 0; i < bench->buffers; i++){
+            // Vary the payload per buffer so a mixed-up buffer shows
+            unsigned p = (round + i) % BENCH_PAYLOADS;
+            struct aesd_buffer_entry entry = {.buffptr = payloads[p], .size = payloadSizes[p]};
+            aesd_circular_buffer_add_entry(buffers[i], &entry);
+
+            struct aesd_circular_buffer *buffer = buffers[i];
+            size_t held = buffer->end_pos - buffer->entry_start[buffer->out_offs];
+            size_t offset;
+            struct aesd_buffer_entry *last = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, held - 1,
+                                                                                             &offset);
+            if(last == NULL || last->buffptr != payloads[p] || offset != payloadSizes[p] - 1){
+                bench->failures++;
+            }
+        }
+    }
+    bench->addNs = monotonicNs() - start;
+
+    start = monotonicNs();
+    for(unsigned i = 0; i < bench->buffers; i++){
+        aesd_circular_buffer_free(bench->slab, buffers[i]);
+    }
+    bench->freeNs = monotonicNs() - start;
+
+    free(buffers);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+    unsigned buffersPerThread = argc > 2 ? strtoul(argv[2], NULL, 10) : 4096;
+    unsigned entries = argc > 3 ? strtoul(argv[3], NULL, 10) : 64;
+    if(threads == 0 || buffersPerThread == 0 || entries == 0){
+        fprintf(stderr, "usage: %s [threads] [buffers_per_thread] [entries_per_buffer]\n", argv[0]);
+        return 1;
+    }
+
+    for(int i = 0; i < BENCH_PAYLOADS; i++){
+        payloadSizes[i] = snprintf(payloads[i], sizeof(payloads[i]), "%.*s\n", i + 1, "abcdefghijklmnopqrstuvwxyz");
+    }
+
+    struct aesd_circular_buffer_slab slab;
+    if(aesd_circular_buffer_slab_init(&slab) != 0){
+        fprintf(stderr, "aesd_circular_buffer_slab_init failed\n");
+        return 1;
+    }
+
+    bench_thread_t *bench = calloc(threads, sizeof(*bench));
+    if(bench == NULL){
+        perror("calloc");
+        return 1;
+    }
+
+    uint64_t start = monotonicNs();
+    for(unsigned t = 0; t < threads; t++){
+        bench[t].slab = &slab;
+        bench[t].buffers = buffersPerThread;
+        bench[t].entries = entries;
+        if(pthread_create(&bench[t].thread, NULL, benchThread, &bench[t]) != 0){
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    uint64_t allocNs = 0, addNs = 0, freeNs = 0;
+    unsigned long buffers = 0, failures = 0;
+    for(unsigned t = 0; t < threads; t++){
+        pthread_join(bench[t].thread, NULL);
+        allocNs += bench[t].allocNs;
+        addNs += bench[t].addNs;
+        freeNs += bench[t].freeNs;
+        buffers += bench[t].buffers;
+        failures += bench[t].failures;
+    }
+    uint64_t wallNs = monotonicNs() - start;
+
+    double adds = (double) buffers * entries;
+    printf("%u threads, %lu buffers of %d entries (%zu bytes each), %u adds per buffer\n", threads, buffers,
+           AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, sizeof(struct aesd_circular_buffer), entries);
+    printf("alloc %8.1f ns/buffer\n", buffers ? (double) allocNs / buffers : 0.0);
+    printf("add   %8.1f ns/add+lookup\n", adds > 0 ? (double) addNs / adds : 0.0);
+    printf("free  %8.1f ns/buffer\n", buffers ? (double) freeNs / buffers : 0.0);
+    printf("total %8.1f M adds/s across threads, %lu failed checks\n", adds / wallNs * 1000.0, failures);
+
+    aesd_circular_buffer_slab_destroy(&slab);
+    free(bench);
+    return failures == 0 ? 0 : 1;
+}
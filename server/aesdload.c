@@ -0,0 +1,577 @@
+/**
+ * @file aesdload.c
+ * @brief Load generator and latency benchmark for aesdsocket.
+ *
+ * Build with "make load". Runs N client threads, each with its own connection, against a running
+ * server. Every request sends one packet and waits for its whole replay; latency runs from the send
+ * (or, with a target rate, from when the send was due) until the last replay byte arrives. A reply
+ * that doesn't end with the request's own packet counts as an error.
+ *
+ * Results go to stdout as a single JSON object, a readable summary to stderr.
+ *
+ * Usage: ./aesdload [-h host] [-p port] [-c connections] [-r total_rate] [-t seconds] [-n requests]
+ *                   [-s size[,size...]] [-L empty|small|medium|large|bytes] [-k] [-i]
+ *   -k  keep-alive: send every request on one connection (server must run with -k; without -k on the
+ *       client, a keep-alive server only ends each reply after its idle timeout)
+ *   -i  incremental: send a replay cursor line first, so replies carry only new log bytes
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "protocol.h"
+
+#define LOAD_MAX_CONNECTIONS (4096)
+#define LOAD_MAX_SIZES (16)
+#define LOAD_MIN_PACKET_BYTES (32)
+#define LOAD_RECV_BUFFER_BYTES (64 * 1024)
+#define LOAD_PREFILL_CHUNK_BYTES (64 * 1024)
+
+typedef struct load_config_s {
+    const char *host;
+    const char *port;
+    int connections;
+    double rate;            // Requests per second across all connections; 0 sends as fast as replies allow
+    int durationSec;
+    uint64_t maxRequests;   // 0 for no limit
+    size_t sizes[LOAD_MAX_SIZES];
+    int numSizes;
+    size_t prefillBytes;
+    const char *prefillName;
+    bool keepAlive;
+    bool incremental;
+} load_config_t;
+
+/**
+ * One client thread's results
+ */
+typedef struct load_client_s {
+    pthread_t thread;
+    int id;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytesSent;
+    uint64_t bytesReceived;
+    uint64_t *latencies;    // ns, one per successful request
+    size_t numLatencies;
+    size_t latencyCapacity;
+} load_client_t;
+
+static load_config_t config = {
+    .host = "localhost",
+    .port = "9000",
+    .connections = 1,
+    .durationSec = 10,
+    .sizes = {64},
+    .numSizes = 1,
+    .prefillName = "empty",
+};
+static struct addrinfo *serverAddr;
+static uint64_t runStartNs;
+static uint64_t runEndNs;
+static atomic_uint_fast64_t requestsIssued;
+
+static uint64_t monotonicNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void sleepUntilNs(uint64_t ns)
+{
+    struct timespec ts = {.tv_sec = ns / 1000000000u, .tv_nsec = ns % 1000000000u};
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/**
+ * @return A connected socket, or -1 on failure
+ */
+static int connectServer(void)
+{
+    int fd = socket(serverAddr->ai_family, serverAddr->ai_socktype, serverAddr->ai_protocol);
+    if(fd == -1){
+        return -1;
+    }
+    if(connect(fd, serverAddr->ai_addr, serverAddr->ai_addrlen) == -1){
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/**
+ * @return 0 once all len bytes are sent, -1 on failure
+ */
+static int sendAll(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    while(len > 0){
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Grows the log by config.prefillBytes, sent as one packet on its own connection
+ * @return Log size afterwards (the length of the replay), or -1 on failure
+ */
+static ssize_t prefillLog(void)
+{
+    int fd = connectServer();
+    if(fd == -1){
+        perror("prefill connect");
+        return -1;
+    }
+
+    char *chunk = malloc(LOAD_PREFILL_CHUNK_BYTES);
+    if(chunk == NULL){
+        close(fd);
+        return -1;
+    }
+    memset(chunk, 'p', LOAD_PREFILL_CHUNK_BYTES);
+
+    int rc = 0;
+    for(size_t left = config.prefillBytes; left > 0 && rc == 0;){
+        size_t n = left < LOAD_PREFILL_CHUNK_BYTES ? left : LOAD_PREFILL_CHUNK_BYTES;
+        if(n == left){
+            chunk[n - 1] = '\n';
+        }
+        rc = sendAll(fd, chunk, n);
+        left -= n;
+    }
+    shutdown(fd, SHUT_WR);
+
+    ssize_t logBytes = 0;
+    ssize_t n;
+    while(rc == 0 && (n = recv(fd, chunk, LOAD_PREFILL_CHUNK_BYTES, 0)) > 0){
+        logBytes += n;
+    }
+
+    free(chunk);
+    close(fd);
+    if(rc == -1){
+        perror("prefill send");
+        return -1;
+    }
+    return logBytes;
+}
+
+static void recordLatency(load_client_t *client, uint64_t ns)
+{
+    if(client->numLatencies == client->latencyCapacity){
+        size_t capacity = client->latencyCapacity ? client->latencyCapacity * 2 : 1024;
+        uint64_t *temp = realloc(client->latencies, capacity * sizeof(*temp));
+        if(temp == NULL){
+            return; // Drop the sample rather than the run
+        }
+        client->latencies = temp;
+        client->latencyCapacity = capacity;
+    }
+    client->latencies[client->numLatencies++] = ns;
+}
+
+/**
+ * @brief Fills packet with a unique, newline terminated packet of exactly len bytes
+ */
+static void buildPacket(char *packet, size_t len, int clientId, uint64_t seq)
+{
+    int n = snprintf(packet, len, "c%d-%llu ", clientId, (unsigned long long) seq);
+    memset(packet + n, 'a', len - n - 1);
+    packet[len - 1] = '\n';
+}
+
+/**
+ * @brief Reads the replay of packet: up to EOF without keep-alive, otherwise until the received bytes end
+ *          with packet (the server always ends a replay with the packet that triggered it)
+ * @return 0 if the replay ended with packet, -1 otherwise
+ */
+static int readReplay(load_client_t *client, int fd, char *buffer, const char *packet, size_t packetLen,
+                      char *tail)
+{
+    size_t tailLen = 0;
+    while(1)
+    {
+        ssize_t n = recv(fd, buffer, LOAD_RECV_BUFFER_BYTES, 0);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            // Without keep-alive EOF is the end of the replay
+            return !config.keepAlive && n == 0 && tailLen == packetLen &&
+                   memcmp(tail, packet, packetLen) == 0 ? 0 : -1;
+        }
+        client->bytesReceived += n;
+
+        // Keep the last packetLen bytes received
+        if((size_t) n >= packetLen){
+            memcpy(tail, buffer + n - packetLen, packetLen);
+            tailLen = packetLen;
+        } else {
+            size_t keep = tailLen + n > packetLen ? packetLen - n : tailLen;
+            memmove(tail, tail + tailLen - keep, keep);
+            memcpy(tail + keep, buffer, n);
+            tailLen = keep + n;
+        }
+
+        if(config.keepAlive && tailLen == packetLen && memcmp(tail, packet, packetLen) == 0){
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief Opens a connection, switching it to incremental replay if asked
+ * @return The socket, or -1 on failure
+ */
+static int openClientConnection(load_client_t *client)
+{
+    int fd = connectServer();
+    if(fd == -1){
+        return -1;
+    }
+    if(config.incremental){
+        // Start past the end of the log (the server clamps it), so the line itself is answered with nothing
+        char line[64];
+        int n = snprintf(line, sizeof(line), PROTOCOL_REPLAY_FROM_CMD "%zu\n", SIZE_MAX);
+        if(sendAll(fd, line, n) == -1){
+            close(fd);
+            return -1;
+        }
+        client->bytesSent += n;
+    }
+    return fd;
+}
+
+/**
+ * @brief Pthread body of one client: issues requests until the run ends
+ */
+static void *clientThread(void *arg)
+{
+    load_client_t *client = arg;
+    size_t maxSize = 0;
+    for(int i = 0; i < config.numSizes; i++){
+        maxSize = config.sizes[i] > maxSize ? config.sizes[i] : maxSize;
+    }
+    char *buffer = malloc(LOAD_RECV_BUFFER_BYTES);
+    char *packet = malloc(maxSize);
+    char *tail = malloc(maxSize);
+    if(buffer == NULL || packet == NULL || tail == NULL){
+        free(buffer);
+        free(packet);
+        free(tail);
+        client->errors++;
+        return NULL;
+    }
+
+    // Each client paces itself at its share of the target rate, staggered so they don't send in lockstep
+    uint64_t intervalNs = config.rate > 0 ? (uint64_t) (1e9 * config.connections / config.rate) : 0;
+    uint64_t dueNs = runStartNs + intervalNs * client->id / config.connections;
+    int fd = -1;
+
+    for(uint64_t seq = 0; ; seq++)
+    {
+        if(intervalNs > 0){
+            sleepUntilNs(dueNs);
+        }
+        uint64_t startNs = intervalNs > 0 ? dueNs : monotonicNs();
+        if(monotonicNs() >= runEndNs){
+            break;
+        }
+        if(config.maxRequests > 0 && atomic_fetch_add(&requestsIssued, 1) >= config.maxRequests){
+            break;
+        }
+        dueNs += intervalNs;
+
+        size_t packetLen = config.sizes[seq % config.numSizes];
+        buildPacket(packet, packetLen, client->id, seq);
+        client->requests++;
+
+        if(fd == -1 && (fd = openClientConnection(client)) == -1){
+            client->errors++;
+            continue;
+        }
+
+        int rc = sendAll(fd, packet, packetLen);
+        if(rc == 0){
+            client->bytesSent += packetLen;
+            rc = readReplay(client, fd, buffer, packet, packetLen, tail);
+        }
+
+        if(rc == 0){
+            recordLatency(client, monotonicNs() - startNs);
+        } else {
+            client->errors++;
+        }
+
+        if(rc == -1 || !config.keepAlive){
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if(fd != -1){
+        close(fd);
+    }
+    free(buffer);
+    free(packet);
+    free(tail);
+    return NULL;
+}
+
+static int compareU64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @return Value at quantile q of sorted[0, n), nearest rank
+ */
+static uint64_t quantile(const uint64_t *sorted, size_t n, double q)
+{
+    if(n == 0){
+        return 0;
+    }
+    size_t rank = (size_t) (q * n + 0.999999);
+    if(rank == 0){
+        rank = 1;
+    }
+    return sorted[(rank > n ? n : rank) - 1];
+}
+
+/**
+ * @return Bytes for a log size preset name, or a plain byte count; -1 if neither
+ */
+static ssize_t parsePrefill(const char *arg)
+{
+    static const struct { const char *name; size_t bytes; } presets[] = {
+        {"empty", 0},
+        {"small", 64 * 1024},
+        {"medium", 4 * 1024 * 1024},
+        {"large", 64 * 1024 * 1024},
+    };
+    for(size_t i = 0; i < sizeof(presets) / sizeof(presets[0]); i++){
+        if(strcmp(arg, presets[i].name) == 0){
+            return presets[i].bytes;
+        }
+    }
+
+    char *end;
+    unsigned long long bytes = strtoull(arg, &end, 10);
+    return *end == '\0' && end != arg ? (ssize_t) bytes : -1;
+}
+
+/**
+ * @return 0 if arg is a valid comma separated list of packet sizes, stored in config, -1 otherwise
+ */
+static int parseSizes(const char *arg)
+{
+    config.numSizes = 0;
+    const char *p = arg;
+    while(*p != '\0'){
+        if(config.numSizes == LOAD_MAX_SIZES){
+            return -1;
+        }
+        char *end;
+        unsigned long long size = strtoull(p, &end, 10);
+        if(end == p || size < LOAD_MIN_PACKET_BYTES || (*end != ',' && *end != '\0')){
+            return -1;
+        }
+        config.sizes[config.numSizes++] = size;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return config.numSizes > 0 ? 0 : -1;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-r total_rate] [-t seconds] [-n requests] "
+            "[-s size[,size...]] [-L empty|small|medium|large|bytes] [-k] [-i]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while((opt = getopt(argc, argv, "c:h:ikL:n:p:r:s:t:")) != -1)
+    {
+        switch(opt){
+        case 'c':
+            config.connections = atoi(optarg);
+            if(config.connections < 1 || config.connections > LOAD_MAX_CONNECTIONS){
+                fprintf(stderr, "Connections must be 1-%d\n", LOAD_MAX_CONNECTIONS);
+                return 1;
+            }
+            break;
+        case 'h':
+            config.host = optarg;
+            break;
+        case 'i':
+            config.incremental = true;
+            break;
+        case 'k':
+            config.keepAlive = true;
+            break;
+        case 'L': {
+            ssize_t bytes = parsePrefill(optarg);
+            if(bytes < 0){
+                fprintf(stderr, "Unknown log size preset %s\n", optarg);
+                return 1;
+            }
+            config.prefillBytes = bytes;
+            config.prefillName = optarg;
+            break;
+        }
+        case 'n':
+            config.maxRequests = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            config.port = optarg;
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            if(config.rate < 0){
+                fprintf(stderr, "Rate must be 0 (unpaced) or more requests per second\n");
+                return 1;
+            }
+            break;
+        case 's':
+            if(parseSizes(optarg) == -1){
+                fprintf(stderr, "Packet sizes must be a list of at most %d sizes of %d bytes or more\n",
+                        LOAD_MAX_SIZES, LOAD_MIN_PACKET_BYTES);
+                return 1;
+            }
+            break;
+        case 't':
+            config.durationSec = atoi(optarg);
+            if(config.durationSec < 1){
+                fprintf(stderr, "Duration must be at least 1 second\n");
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc){
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int rc = getaddrinfo(config.host, config.port, &hints, &serverAddr);
+    if(rc != 0){
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        return 1;
+    }
+
+    ssize_t logBytesBefore = 0;
+    if(config.prefillBytes > 0 && (logBytesBefore = prefillLog()) == -1){
+        freeaddrinfo(serverAddr);
+        return 1;
+    }
+
+    load_client_t *clients = calloc(config.connections, sizeof(*clients));
+    if(clients == NULL){
+        perror("calloc clients");
+        freeaddrinfo(serverAddr);
+        return 1;
+    }
+
+    runStartNs = monotonicNs();
+    runEndNs = runStartNs + (uint64_t) config.durationSec * 1000000000u;
+    int started = 0;
+    for(int i = 0; i < config.connections; i++){
+        clients[i].id = i;
+        if(pthread_create(&clients[i].thread, NULL, clientThread, &clients[i]) != 0){
+            perror("pthread_create client");
+            break;
+        }
+        started++;
+    }
+
+    load_client_t total = {0};
+    for(int i = 0; i < started; i++){
+        pthread_join(clients[i].thread, NULL);
+        total.requests += clients[i].requests;
+        total.errors += clients[i].errors;
+        total.bytesSent += clients[i].bytesSent;
+        total.bytesReceived += clients[i].bytesReceived;
+        total.numLatencies += clients[i].numLatencies;
+    }
+    double elapsedSec = (monotonicNs() - runStartNs) / 1e9;
+
+    uint64_t *latencies = malloc((total.numLatencies ? total.numLatencies : 1) * sizeof(*latencies));
+    size_t n = 0;
+    uint64_t sumNs = 0;
+    for(int i = 0; i < started; i++){
+        for(size_t j = 0; latencies != NULL && j < clients[i].numLatencies; j++){
+            latencies[n++] = clients[i].latencies[j];
+            sumNs += clients[i].latencies[j];
+        }
+        free(clients[i].latencies);
+    }
+    if(n > 0){
+        qsort(latencies, n, sizeof(*latencies), compareU64);
+    }
+
+    uint64_t p50 = quantile(latencies, n, 0.5);
+    uint64_t p99 = quantile(latencies, n, 0.99);
+    uint64_t p999 = quantile(latencies, n, 0.999);
+    uint64_t maxNs = n ? latencies[n - 1] : 0;
+    uint64_t meanNs = n ? sumNs / n : 0;
+
+    char sizes[LOAD_MAX_SIZES * 24] = "";
+    for(int i = 0; i < config.numSizes; i++){
+        size_t len = strlen(sizes);
+        snprintf(sizes + len, sizeof(sizes) - len, "%s%zu", i ? "," : "", config.sizes[i]);
+    }
+
+    printf("{\"host\":\"%s\",\"port\":\"%s\",\"connections\":%d,\"keep_alive\":%s,\"incremental\":%s,"
+           "\"target_rate\":%.1f,\"packet_sizes\":[%s],\"log_preset\":\"%s\",\"log_bytes_start\":%zd,"
+           "\"duration_s\":%.3f,\"requests\":%llu,\"completed\":%zu,\"errors\":%llu,"
+           "\"bytes_sent\":%llu,\"bytes_received\":%llu,\"requests_per_s\":%.1f,\"replay_mb_per_s\":%.2f,"
+           "\"latency_ns\":{\"mean\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+           config.host, config.port, config.connections, config.keepAlive ? "true" : "false",
+           config.incremental ? "true" : "false", config.rate, sizes, config.prefillName, logBytesBefore,
+           elapsedSec, (unsigned long long) total.requests, n, (unsigned long long) total.errors,
+           (unsigned long long) total.bytesSent, (unsigned long long) total.bytesReceived,
+           n / elapsedSec, total.bytesReceived / elapsedSec / 1e6,
+           (unsigned long long) meanNs, (unsigned long long) p50, (unsigned long long) p99,
+           (unsigned long long) p999, (unsigned long long) maxNs);
+
+    fprintf(stderr, "%zu/%llu requests ok (%llu errors) in %.2f s: %.0f req/s, %.1f MB/s replayed\n"
+            "latency us: mean %.1f  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+            n, (unsigned long long) total.requests, (unsigned long long) total.errors, elapsedSec,
+            n / elapsedSec, total.bytesReceived / elapsedSec / 1e6,
+            meanNs / 1e3, p50 / 1e3, p99 / 1e3, p999 / 1e3, maxNs / 1e3);
+
+    free(latencies);
+    free(clients);
+    freeaddrinfo(serverAddr);
+    return total.errors > 0 ? 2 : 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
@@ -12,123 +13,127 @@
 #include <syslog.h>
 #include <stdbool.h>
 #include <sys/stat.h>
-#include "queue.h"
 #include <pthread.h>
 #include <sys/time.h>
 #include <stdatomic.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include "logstore.h"
+#include "bufpool.h"
+#include "protocol.h"
+#include "framing.h"
+#include "metrics.h"
+#include "timestamp.h"
+#include "dlog.h"
+#include "handoff.h"
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
 
 #define MAX_SOCK_CONNECTIONS (100)
 #define LOG_PATH ("/var/tmp/aesdsocketdata")
 #define SOCKET_PORT ("9000")
-#define RECV_BUFFER_LENGTH_BYTES (32)
-#define ITIMER_PERIOD_SEC (10)
+#define DEFAULT_TIMESTAMP_INTERVAL_MS (10000)
+#define DEFAULT_EVENT_LOOPS (2)
+#define DEFAULT_POOL_WORKERS (8)
+#define DEFAULT_ACCEPT_QUEUE_DEPTH (64)
+#define DEFAULT_SPILL_THRESHOLD_BYTES (1024 * 1024)
+#define DEFAULT_MAX_PACKET_BYTES ((size_t) 1024 * 1024 * 1024)
+#define DEFAULT_STALL_DEADLINE_SEC (30)
+#define MAX_SERVE_THREADS (256)
+#define MAX_LISTEN_SHARDS (MAX_SERVE_THREADS)
+#define EPOLL_MAX_EVENTS (64)
 
 typedef struct sockaddr sockaddr_t;
 typedef struct addrinfo addrinfo_t;
 
+// Connection serving model, chosen at startup with -m
+typedef enum {
+    SERVE_MODE_POOL,    // Fixed worker pool fed by a bounded accept queue
+    SERVE_MODE_EPOLL,   // Edge-triggered epoll on a fixed set of loop threads
+    SERVE_MODE_URING,   // io_uring loops (USE_IO_URING builds), falls back to pool if unsupported
+} serve_mode_t;
+
 // Globally available addrinfo to clean after program terminates
 addrinfo_t *addrinfo = NULL;
-int sockfd = -1;
-int logfd = -1;
+int listenFds[MAX_LISTEN_SHARDS]; // One listener, or one SO_REUSEPORT listener per shard
+int numListenFds = 0;
+int numListenShards = 1; // -s: listeners to open; 0 means one per online CPU
+bool pinShards = false;  // -c: pin each shard's accept/serve thread to its own CPU
+logstore_t logStore;
 // int clientfd = -1;
 volatile int endProgram = 0;
+volatile sig_atomic_t caughtSignal = 0; // Set by handle_sigint, logged once serving has stopped
 bool runAsDaemon = false;
-pthread_mutex_t logMutex;
-timer_t intervalTimerID = 0;
-
-// SLIST.
-typedef struct slist_data_s slist_data_t;
-struct slist_data_s {
-    pthread_t thread;      
-    _Atomic bool isThreadComplete;
-    int clientfd;
-    SLIST_ENTRY(slist_data_s) entries;
-};
-
-SLIST_HEAD(threadListHead, slist_data_s) head;
+timestamp_writer_t timestampWriter = {.fd = -1}; // Ticks in loop 0 of the event loops, or its own thread in pool mode
+unsigned timestampIntervalMs = DEFAULT_TIMESTAMP_INTERVAL_MS; // -i: milliseconds between timestamp lines
+serve_mode_t serveMode = SERVE_MODE_POOL;
+int numServeThreads = 0; // Event loops or pool workers; 0 picks the mode's default
+size_t acceptQueueDepth = DEFAULT_ACCEPT_QUEUE_DEPTH;
+bool syncLogOnCommit = false; // -f: appends return only once msync'd to disk
+bool rejectWhenSaturated = false; // Pool full: false waits (kernel backlog holds clients), true closes new clients
+int keepAliveIdleSec = 0; // -k: serve many packets per connection, closing after this many idle seconds
+size_t spillThresholdBytes = DEFAULT_SPILL_THRESHOLD_BYTES; // -t: partial packets this big move from memory to a stage file
+size_t maxPacketBytes = DEFAULT_MAX_PACKET_BYTES; // -l: connections sending a bigger packet are dropped
+int stallDeadlineSec = DEFAULT_STALL_DEADLINE_SEC; // -w: drop clients whose replay makes no progress this long; 0 never
+logstore_retention_t logRetention = {0}; // -a/-b/-e: keep only a window of the log; all zero keeps everything
+const char *statsSocketPath = NULL; // -p: serve metrics on a Unix socket at this path
+int shutdownEventFd = -1; // Written from the signal handler to wake every event loop
+const char *handoffPath = NULL; // -H: take over from / hand over to another aesdsocket through this Unix socket
+volatile int handingOff = 0; // A new process asked to take over: drain connections instead of dropping them
+bool handedOff = false; // The new process has the listeners and the log; leave the log file in place
+bool keepLog = false; // A handoff failed on the way out: leave the log file for whoever tries again
+handoff_t inherited = {.logFd = -1}; // What the process we took over from handed us
 
 int cleanupProgram();
 
 /**
  * @brief Signal Handler. Expects SIGINT and SIGTERM to end program.
+ * @details Only async-signal-safe work here: the serving model notices endProgram once woken, and listenLoop
+ *          logs the signal after it returns.
  */
 void handle_sigint(int sig) {
-    syslog(LOG_DEBUG, "Caught signal, exiting");
+    int savedErrno = errno;
+    caughtSignal = sig;
+    endProgram = 1; // Set flag to cleanup and end the program
 
-    if(sig == SIGINT || sig == SIGTERM){
-        endProgram = 1;
-    } else {
-        syslog(LOG_DEBUG, "Caught unknown signal. Exiting.");
+    if(shutdownEventFd != -1){
+        // write() is async-signal-safe; wakes all epoll loops so they notice endProgram
+        uint64_t one = 1;
+        write(shutdownEventFd, &one, sizeof(one));
     }
-
-    endProgram = 1; // Set flag to cleanup and end the program
+    errno = savedErrno;
 }
 
 /**
- * @brief POSIX Interval timer callback thread. Logs timestamps to LOG_PATH
+ * @brief Sets the listen backlog of every listener
  */
-static void timerCallback(union sigval sv)
+static void listenAll(int backlog)
 {
-
-    (void) sv;
-    // TODO: Print something to log
-    char str[64] = {0};
-    time_t rawTime;
-    struct tm timeStruct = {0};
-
-    time(&rawTime);
-    localtime_r(&rawTime, &timeStruct);
-
-    snprintf(str, sizeof(str), "timestamp:");
-    
-    int charsWritten = strftime(str+10, sizeof(str) - 10, "%a, %d %b %Y %T %z", &timeStruct);
-    if(charsWritten > sizeof(str)){
-        printf("Zane made bad size of arr!\n");
-        return;
+    for(int i = 0; i < numListenFds; i++){
+        if(listen(listenFds[i], backlog) == -1){
+            perror("listen failed");
+        }
     }
-
-    charsWritten += 10; // Increment by the "timestamp:" chars
-    
-    str[charsWritten] = '\n';
-    charsWritten += 1; // Make room for newline
-
-    pthread_mutex_lock(&logMutex);
-    write(logfd, str, charsWritten);
-    pthread_mutex_unlock(&logMutex);
-
-    return;
 }
 
 /**
- * @brief Create and start interval timer for logging service
+ * @brief Called from the handoff server thread when a new process asks to take over. Stops serving like
+ *          SIGTERM does, but connections in flight are drained first.
  */
-int startIntervalLoggingTimer()
+static void requestHandoff(void)
 {
-    struct sigevent sev = {0};
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_notify_function = timerCallback;
-    sev.sigev_notify_attributes = NULL;
-
-    int rc = timer_create(CLOCK_MONOTONIC, &sev, &intervalTimerID);
-    if(rc == -1){
-        perror("timer create failed");
-        return -1;
-    }
-
-    struct itimerspec timerData = {0};
-    timerData.it_interval.tv_sec = ITIMER_PERIOD_SEC;
-    timerData.it_value.tv_sec = ITIMER_PERIOD_SEC;
-
-    rc = timer_settime(intervalTimerID, 0, &timerData, NULL);
-    if(rc == -1){
-        perror("timer_settime failed");
-        return -1;
+    DLOG(LOG_INFO, "Handoff requested - draining connections");
+    // Nobody accepts until the new process has the listeners; let clients queue rather than be refused
+    listenAll(SOMAXCONN);
+    handingOff = 1;
+    endProgram = 1;
+    if(shutdownEventFd != -1){
+        uint64_t one = 1;
+        write(shutdownEventFd, &one, sizeof(one));
     }
-
-    // printf("itimer should be set up\n");
-
-    return 0;
 }
 
 /**
@@ -136,37 +141,55 @@ int startIntervalLoggingTimer()
  */
 int cleanupProgram()
 {
+    // Stop timestamp appends before the log store goes away
+    timestamp_close(&timestampWriter);
+    handoff_server_stop();
+
     if(addrinfo != NULL){
         freeaddrinfo(addrinfo);
         addrinfo = NULL;
     }
 
-    if(sockfd != -1){
-        close(sockfd);
-        sockfd = -1;
+    for(int i = 0; i < numListenFds; i++){
+        close(listenFds[i]);
     }
+    numListenFds = 0;
 
-    if(logfd != -1){
-        close(logfd);
-        logfd = -1;
-    }
+    metrics_server_stop();
 
-    int rc;
-    rc = access(LOG_PATH, F_OK);
-    if(rc == 0){
-        rc = remove(LOG_PATH);
-        if(rc == -1){
-            perror("remove failed");
+    if(handedOff){
+        // The new process is appending to it now
+        logstore_detach(&logStore);
+    } else {
+        logstore_close(&logStore);
+
+        int rc;
+        rc = keepLog ? -1 : access(LOG_PATH, F_OK);
+        if(rc == 0){
+            rc = remove(LOG_PATH);
+            if(rc == -1){
+                perror("remove failed");
+            }
         }
     }
 
+    if(shutdownEventFd != -1){
+        close(shutdownEventFd);
+        shutdownEventFd = -1;
+    }
+
     printf("Cleaned!\n");
+    return 0;
 }
 
 /**
  * @brief Helper function to print the connecting client's address and port.
  */
 void printClientNameConnected(struct sockaddr *clientaddr, size_t clientAddrSize){
+    if(!dlog_enabled(LOG_INFO)){
+        return; // Skip the address lookup too
+    }
+
     char host[NI_MAXHOST];
     char service[NI_MAXSERV];
     int rc;
@@ -182,7 +205,7 @@ void printClientNameConnected(struct sockaddr *clientaddr, size_t clientAddrSize
     if (rc != 0) {
         fprintf(stderr, "getnameinfo: %s\n", gai_strerror(rc));
     } else {
-        syslog(LOG_DEBUG, "Accepted connection from %s:%s\n", host, service);
+        DLOG(LOG_INFO, "Accepted connection from %s:%s\n", host, service);
     }
 }
 
@@ -191,6 +214,10 @@ void printClientNameConnected(struct sockaddr *clientaddr, size_t clientAddrSize
  * 
  */
 void printClientNameDisconnected(struct sockaddr *clientaddr){
+    if(!dlog_enabled(LOG_INFO)){
+        return; // Skip the address lookup too
+    }
+
     char host[NI_MAXHOST];
     char service[NI_MAXSERV];
     int rc;
@@ -206,43 +233,76 @@ void printClientNameDisconnected(struct sockaddr *clientaddr){
     if (rc != 0) {
         fprintf(stderr, "getnameinfo: %s\n", gai_strerror(rc));
     } else {
-        syslog(LOG_DEBUG, "Closed connection from %s:%s\n", host, service);
+        DLOG(LOG_INFO, "Closed connection from %s:%s\n", host, service);
 
     }
 }
 
 /**
- * @brief Opens a stream-style socket on port specified
- * @return 0 on success, -1 on failure.
+ * @brief Opens and binds one stream-style listener on the address in addrinfo
+ * @arg reusePort set SO_REUSEPORT so several listeners can share the port
+ * @return The socket, or -1 on failure.
  */
-int openSocket(const char* port){
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);    
-    if(sockfd == -1){
+static int openListener(bool reusePort)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd == -1){
         perror("no sockfd returned from socket()");
         return -1;
     }
 
-    struct addrinfo hints = {.ai_flags = AI_PASSIVE, .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
-    int rc;
-    rc = getaddrinfo(NULL, port, &hints, &addrinfo);
-    if(rc != 0){
-        perror("getaddrinfo failed");
-        return -1;
-    }
-
     int val = 1;
-    rc = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    int rc = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    if(rc == 0 && reusePort){
+        rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+    }
     if(rc == -1){
         perror("Failed setsockopt");
+        close(fd);
         return -1;
     }
 
-    rc = bind(sockfd, addrinfo->ai_addr, addrinfo->ai_addrlen);
+    rc = bind(fd, addrinfo->ai_addr, addrinfo->ai_addrlen);
     if(rc == -1){
         perror("bind failed");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Opens numListenShards stream-style sockets on port specified. With more than one shard each
+ *          gets SO_REUSEPORT and the kernel spreads incoming connections across them.
+ * @return 0 on success, -1 on failure.
+ */
+int openSocket(const char* port){
+    struct addrinfo hints = {.ai_flags = AI_PASSIVE, .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int rc;
+    rc = getaddrinfo(NULL, port, &hints, &addrinfo);
+    if(rc != 0){
+        perror("getaddrinfo failed");
         return -1;
     }
 
+    for(int i = 0; i < numListenShards; i++){
+        int fd = openListener(numListenShards > 1);
+        if(fd == -1){
+            return -1;
+        }
+        listenFds[numListenFds++] = fd;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Forks into the background when -d was given; the parent exits
+ * @return 0 on success, -1 on failure.
+ */
+static int daemonize()
+{
     if(runAsDaemon)
     {
         pid_t newpid = fork();
@@ -271,257 +331,1779 @@ int openSocket(const char* port){
 }
 
 /**
- * @brief Sends the full log of what was received on the socket to newfd
- * @details NOT thread-safe!! Use mutex around me for logdata!
- * @return Returns 0 on success, -1 on failure.
+ * @brief Sends log bytes [from, to) to newfd
+ * @details Thread-safe without locking. to is a packet boundary at or below the committed size, so the
+ *          replay is consistent while other threads keep appending.
+ *          Bytes are sent straight out of the log mapping (through a bounded snapshot for a retention ring),
+ *          so memory use is constant regardless of log size.
+ *          Sends never block: when the socket is full it waits for writability, and gives up once the client
+ *          has accepted nothing for stallDeadlineSec.
+ * @return Returns the log offset the replay ended at, -1 on failure.
  */
-int sendFullLog(int newfd)
+ssize_t sendLog(int newfd, size_t from, size_t to)
 {
-    int fd = open(LOG_PATH, O_RDONLY);
-    if (fd == -1) {
-        perror("open log for read");
-        return -1;
+    size_t fsize = to;
+    int stallMs = stallDeadlineSec > 0 ? stallDeadlineSec * 1000 : -1;
+
+    logstore_snapshot_t snapshot = {0};
+    ssize_t rc = fsize;
+
+    // send() may write fewer bytes than requested, so loop until done
+    size_t sent = from < fsize ? from : fsize;
+    while(sent < fsize){
+        size_t len;
+        const char *chunk = logstore_replay_chunk(&logStore, &snapshot, sent, fsize, &len);
+        if(chunk == NULL){
+            DLOG(LOG_DEBUG, "Replay overtaken by log retention - dropping connection");
+            rc = -1;
+            break;
+        }
+        ssize_t m = send(newfd, chunk, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(m < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                // Socket buffer full; the deadline restarts with every byte the client takes
+                struct pollfd pfd = {.fd = newfd, .events = POLLOUT};
+                int ready = poll(&pfd, 1, stallMs);
+                if(ready == 0){
+                    DLOG(LOG_DEBUG, "Client stalled replay for %d s - dropping connection", stallDeadlineSec);
+                    rc = -1;
+                    break;
+                }
+                if(ready < 0 && errno != EINTR){
+                    perror("poll");
+                    rc = -1;
+                    break;
+                }
+                continue;
+            }
+            perror("send");
+            rc = -1;
+            break;
+        }
+        sent += m;
+        metrics_add(METRIC_BYTES_OUT, m);
     }
 
-    struct stat st;
-    int rc = stat(LOG_PATH, &st);
-    if(rc == -1){
-        perror("Stat failed");
+    logstore_snapshot_release(&snapshot);
+    return rc;
+}
+
+/**
+ * @brief Echoes the log up to offset to back to the client from its replay cursor and advances the cursor
+ * @return 0 on success, -1 if the client failed or stalled and must be dropped.
+ */
+static int replayToClient(int clientFD, protocol_cursor_t *cursor, size_t to)
+{
+    ssize_t end = sendLog(clientFD, protocol_replay_start(cursor, logstore_start(&logStore)), to); // Concurrent appends don't block it
+    if(end < 0){
         return -1;
     }
+    cursor->offset = end;
+    return 0;
+}
+
+/**
+ * @brief Appends one packet to the log: whatever of it is staged, followed by packet[0, len)
+ * @return The log offset just past the packet, or -1 on failure.
+ */
+static ssize_t appendPacket(logstore_stage_t *stage, const uint8_t *packet, size_t len)
+{
+    DLOG(LOG_DEBUG, "Recvd %zu bytes: %.*s", len, (int) (len < DLOG_PAYLOAD_BYTES ? len : DLOG_PAYLOAD_BYTES),
+         (const char *) packet);
 
-    int fsize = st.st_size;
-    // printf("fsize: %d\n", fsize);
+    // Atomic per packet, no lock needed
+    if(stage->len > 0){
+        return logstore_append_staged(&logStore, stage, packet, len);
+    }
+    return logstore_append(&logStore, packet, len);
+}
 
-    char *buf = malloc(sizeof(char) * fsize);
-    if(buf == NULL)
-    {
-        // Malloc failed
-        syslog(LOG_DEBUG, "Malloc failed in sendFullLog");
+/**
+ * @brief Appends one packet to the log and echoes the log back to the client
+ * @return 0 on success, -1 if the client failed or stalled and must be dropped.
+ */
+static int appendPacketAndReplay(int clientFD, logstore_stage_t *stage, const uint8_t *packet, size_t len,
+                                 protocol_cursor_t *cursor)
+{
+    uint64_t startNs = metrics_now_ns();
+    // Like the event loops, the replay ends with this packet rather than whatever was appended after it
+    ssize_t end = appendPacket(stage, packet, len);
+    if(replayToClient(clientFD, cursor, end < 0 ? logstore_size(&logStore) : (size_t) end) == -1){
         return -1;
     }
+    metrics_observe(METRIC_HIST_REPLAY, metrics_now_ns() - startNs);
+    return 0;
+}
 
-    while (1) {
-        ssize_t n = read(fd, buf, fsize);
-        if (n == 0) break;
-        if (n < 0) {
-            perror("read log");
-            close(newfd);
-            free(buf);
-            return -1;
-        }
+/**
+ * @return true, after logging it, if a packet of stagedBytes + bufferedBytes breaks the maxPacketBytes limit
+ */
+static bool packetTooLarge(size_t stagedBytes, size_t bufferedBytes)
+{
+    if(stagedBytes + bufferedBytes <= maxPacketBytes){
+        return false;
+    }
+    DLOG(LOG_ERR, "Packet exceeds the %zu byte limit - dropping connection", maxPacketBytes);
+    return true;
+}
 
-        // send() may write fewer bytes than requested, so loop until done
-        ssize_t sent = 0;
-        while (sent < n) {
-            ssize_t m = send(newfd, buf + sent, (size_t)(n - sent), 0);
-            if (m < 0) {
-                perror("send");
-                close(newfd);
-                free(buf);
-                return -1;
-            }
-            sent += m;
-        }
+/**
+ * @brief Called while the buffer holds only the start of a packet. Once that reaches spillThresholdBytes
+ *          it moves to the stage, so a connection never buffers much more than the threshold in memory.
+ * @arg bufferedBytes in/out bytes in the buffer; 0 after a spill
+ * @arg scanned reset along with the buffer
+ * @return 0 on success, -1 if the packet is over the limit or could not be staged.
+ */
+static int ingestPartialPacket(logstore_stage_t *stage, const uint8_t *buffer, size_t *bufferedBytes, size_t *scanned)
+{
+    if(packetTooLarge(stage->len, *bufferedBytes)){
+        return -1;
+    }
+    if(*bufferedBytes < spillThresholdBytes){
+        return 0;
     }
 
-    free(buf);
-    close(fd);
+    if(stage->fd == -1 && logstore_stage_open(&logStore, stage) == -1){
+        return -1;
+    }
+    if(logstore_stage_write(stage, buffer, *bufferedBytes) == -1){
+        return -1;
+    }
+    *bufferedBytes = 0;
+    *scanned = 0;
     return 0;
 }
 
 /**
- * @brief Pthread recieving thread for multi-threaded server. Spawned on each new connection
- * @arg Pointer to linkedlist node containing thread-specific information  
- * @return None
+ * @return Current CLOCK_MONOTONIC time in whole seconds
  */
-void* repsondingThread(void* arg)
+static time_t monotonicSec()
 {
-    slist_data_t *myNodeData = (slist_data_t*) (arg);
-    int clientFD = myNodeData->clientfd;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * @return Current CLOCK_MONOTONIC time in milliseconds
+ */
+static int64_t monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * A pool connection between workers: queued after accept, or parked between keep-alive packets
+ */
+typedef struct pool_conn_s {
+    int fd;
+    protocol_cursor_t cursor;   // Replay cursor, carried across parking
+    bool served;                // Answered at least one packet or cursor line
+} pool_conn_t;
+
+static int poolPark(const pool_conn_t *conn);
+
+/**
+ * Sockets pool workers are serving right now. A handoff bounds how long it waits for them: they get a receive
+ * timeout when it starts, and whatever is still in flight after HANDOFF_DRAIN_MS is shut down.
+ */
+static int inFlightFds[MAX_SERVE_THREADS];
+static int numInFlight;
+static int64_t poolDrainDeadline;   // monotonicMs() deadline, set when a handoff starts draining the pool
+static bool poolDrainExpired;       // Past poolDrainDeadline; connections still in flight are dropped
+static pthread_mutex_t inFlightLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Bounds the socket's remaining time by the handoff drain deadline. Called with inFlightLock held.
+ */
+static void poolDrainLimit(int fd)
+{
+    if(poolDrainExpired){
+        // Wakes a blocked recv() (returns 0) or send() (fails) so the worker lets go
+        shutdown(fd, SHUT_RDWR);
+        return;
+    }
+    int64_t left = poolDrainDeadline - monotonicMs();
+    left = left > 0 ? left : 1; // Zero would mean no timeout
+    struct timeval timeout = {.tv_sec = left / 1000, .tv_usec = (left % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+/**
+ * @brief Records that a worker is serving fd
+ */
+static void poolTrack(int fd)
+{
+    pthread_mutex_lock(&inFlightLock);
+    inFlightFds[numInFlight++] = fd;
+    if(poolDrainDeadline != 0){
+        poolDrainLimit(fd);
+    }
+    pthread_mutex_unlock(&inFlightLock);
+}
+
+/**
+ * @brief Forgets fd; called before it is closed or parked, so a shutdown never hits a reused descriptor
+ */
+static void poolUntrack(int fd)
+{
+    pthread_mutex_lock(&inFlightLock);
+    for(int i = 0; i < numInFlight; i++){
+        if(inFlightFds[i] == fd){
+            inFlightFds[i] = inFlightFds[--numInFlight];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&inFlightLock);
+}
+
+/**
+ * @return true once a handoff has given up on the connections still in flight
+ */
+static bool poolDrainGaveUp(void)
+{
+    pthread_mutex_lock(&inFlightLock);
+    bool expired = poolDrainExpired;
+    pthread_mutex_unlock(&inFlightLock);
+    return expired;
+}
 
-    syslog(LOG_DEBUG, "New thread reporting for duty!");
+/**
+ * @brief Serves one accepted connection: receives a packet, appends it to the log and echoes the log back.
+ *          In keep-alive mode (-k) keeps answering newline-terminated packets, in order, until the client
+ *          closes its side or stays idle for keepAliveIdleSec. A leading replay cursor line (protocol.h) is
+ *          answered on its own and switches the connection to incremental replay.
+ *          A keep-alive connection with nothing buffered is parked (poolPark) rather than holding the worker
+ *          while it waits for the next packet.
+ * @arg conn accepted or resumed connection, closed or parked before returning
+ */
+static void handleConnection(pool_conn_t *conn)
+{
+    DLOG(LOG_DEBUG, "Worker picked up connection");
+    int clientFD = conn->fd;
+
+    bool keepAlive = keepAliveIdleSec > 0;
+    if(keepAlive){
+        // recv() fails with EAGAIN once the client has been idle this long
+        struct timeval idle = {.tv_sec = keepAliveIdleSec};
+        setsockopt(clientFD, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    }
+    poolTrack(clientFD); // After the idle timeout, which a draining handoff may shorten
 
     // Set up to recv from client
-    size_t bufferCapacity = RECV_BUFFER_LENGTH_BYTES;
-    uint8_t *buffer = (uint8_t*) malloc(bufferCapacity);
-    memset(buffer, 0, bufferCapacity);
-    int totalBytesRecvd = 0; // Reset num bytes received for this message
-    bool failedToRead = false;
+    size_t bufferCapacity;
+    uint8_t *buffer = bufpool_get(BUFPOOL_MIN_BYTES, &bufferCapacity);
+    if(buffer == NULL){
+        printf("Failed to malloc large enough buffer.\n");
+        poolUntrack(clientFD);
+        close(clientFD);
+        metrics_add(METRIC_CLOSES, 1);
+        return;
+    }
+    size_t totalBytesRecvd = 0; // Bytes buffered and not yet appended
+    size_t scanned = 0;         // Leading bytes of the buffer already searched for a newline
+    protocol_cursor_t *cursor = &conn->cursor;
+    logstore_stage_t stage = {.fd = -1}; // Leading part of an oversized packet, opened on first spill
+    bool parked = false;
 
     // Receive all the bytes now
     while(1)
     {
-        // If received bytes on last ittr was at buffer capacity, then double capacity and keep going
+        // A replay cursor line is not a packet: answer it with the delta and keep reading
+        size_t cursorLineLen = stage.len > 0 ? 0 :
+            protocol_apply_replay_from(cursor, buffer, totalBytesRecvd, logstore_size(&logStore));
+        if(cursorLineLen > 0){
+            if(replayToClient(clientFD, cursor, logstore_size(&logStore)) == -1){
+                break;
+            }
+            conn->served = true;
+            totalBytesRecvd -= cursorLineLen;
+            memmove(buffer, buffer + cursorLineLen, totalBytesRecvd);
+            scanned = 0;
+            continue;
+        }
+
+        // Append every complete packet already buffered before reading more, so pipelined packets go in order
+        size_t packetLen = framing_next_packet(buffer, totalBytesRecvd, &scanned);
+        if(packetLen > 0){
+            if(packetTooLarge(stage.len, packetLen)){
+                break;
+            }
+
+            // Without keep-alive the one reply goes out once the buffered bytes end on a packet boundary
+            bool lastPacket = !keepAlive && packetLen == totalBytesRecvd;
+            if(keepAlive || lastPacket){
+                if(appendPacketAndReplay(clientFD, &stage, buffer, packetLen, cursor) == -1){
+                    break;
+                }
+                conn->served = true;
+            } else {
+                appendPacket(&stage, buffer, packetLen);
+            }
+            totalBytesRecvd -= packetLen;
+            memmove(buffer, buffer + packetLen, totalBytesRecvd);
+            scanned = 0;
+            if(lastPacket){
+                break;
+            }
+            continue;
+        }
+
+        // Everything buffered is part of one unfinished packet
+        if(ingestPartialPacket(&stage, buffer, &totalBytesRecvd, &scanned) == -1){
+            break;
+        }
+
+        // If received bytes on last ittr was at buffer capacity, then move up a size class and keep going
         if(totalBytesRecvd == bufferCapacity){
-            bufferCapacity *= 2;
-            uint8_t *temp = realloc(buffer, bufferCapacity);
+            uint8_t *temp = bufpool_grow(buffer, totalBytesRecvd, bufferCapacity + 1, &bufferCapacity);
             if(temp == NULL){
-                free(buffer);
-                // toss this message and go next if malloc failed 
-                failedToRead = true;
+                // toss this message and go next if malloc failed
                 printf("Failed to malloc large enough buffer.\n");
                 break;
             }
 
             buffer = temp;
-            // printf("Doubled buffer size. Now %ld bytes\n", bufferCapacity);
         }
 
-        // Recieve n bytes from the client
-        int n = recv(clientFD, buffer + totalBytesRecvd, bufferCapacity - totalBytesRecvd, 0);
+        // Between packets of a keep-alive connection that has been answered before
+        bool idle = keepAlive && conn->served && totalBytesRecvd == 0 && stage.len == 0;
+
+        // Shutting down (or handing off): don't wait for another packet from a keep-alive client
+        if(idle && endProgram){
+            break;
+        }
+
+        // Recieve n bytes from the client. Between packets only take what has already arrived.
+        ssize_t n = recv(clientFD, buffer + totalBytesRecvd, bufferCapacity - totalBytesRecvd, idle ? MSG_DONTWAIT : 0);
+        if(n < 0 && idle && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            // Nothing yet: free this worker and let the acceptor hand the connection back when it has more
+            poolUntrack(clientFD);
+            parked = poolPark(conn) == 0;
+            break;
+        }
         if(n < 0){
-            // Error on recv
-            free(buffer);
-            buffer = NULL;
-            syslog(LOG_DEBUG, "recv failed");
-            perror("recv failed");
-            return NULL;
+            if(handingOff && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                DLOG(LOG_DEBUG, "Handoff drain deadline reached - dropping connection");
+            } else if(keepAlive && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                DLOG(LOG_DEBUG, "Keep-alive connection idle - closing");
+            } else {
+                // Error on recv
+                DLOG(LOG_DEBUG, "recv failed");
+                perror("recv failed");
+            }
+            break;
         }
 
         if(n == 0){
-            // We read all the data out of the socket
+            if(poolDrainGaveUp()){
+                DLOG(LOG_DEBUG, "Handoff drain deadline reached - dropping connection");
+                break; // Shut down by poolDrain, not by the client: what is buffered is no packet
+            }
+            // Client closed its side; whatever is left is the final (unterminated) packet
+            if(totalBytesRecvd > 0 || stage.len > 0 || !keepAlive){
+                appendPacketAndReplay(clientFD, &stage, buffer, totalBytesRecvd, cursor);
+            }
             break;
         }
 
         totalBytesRecvd += n;
-        // printf("Just read %d bytes, making total of %d\n", n, totalBytesRecvd);
-
-        // Only stop loop if the final char is a newline
-        if(buffer[totalBytesRecvd-1] == '\n'){
-            break;
-        }
+        metrics_add(METRIC_BYTES_IN, n);
     }
 
-    // Trap for failed to read to hit the cleanup and return step at the end of function
-    if(!failedToRead){
-        // If we read completely, write message to the log, free the buffer and echo back log
-        // buffer[totalBytesRecvd] = 0; // Set null-terminator
-        // printf("new buffer: %s", buffer);
-        syslog(LOG_DEBUG, "Recvd string: %s", buffer);
-
-        pthread_mutex_lock(&logMutex);
-        write(logfd, buffer, totalBytesRecvd); // Protext the log write
-        pthread_mutex_unlock(&logMutex);
-
-        if(buffer != NULL)
-        {
-            free(buffer);
-            buffer = NULL;
-        }   
-
-        pthread_mutex_lock(&logMutex);
-        sendFullLog(clientFD); // Protect the log read
-        pthread_mutex_unlock(&logMutex);
+    logstore_stage_close(&stage);
+    bufpool_put(buffer);
+    if(parked){
+        return;
     }
-
+    poolUntrack(clientFD);
     shutdown(clientFD, SHUT_RDWR);
     close(clientFD);
-    clientFD = -1;
-    atomic_store(&myNodeData->isThreadComplete, true);
-    syslog(LOG_DEBUG, "Thread cleaned up");
-
-    return NULL;
-
+    metrics_add(METRIC_CLOSES, 1);
+    conn->fd = -1;
+    DLOG(LOG_DEBUG, "Connection cleaned up");
 }
 
 /**
- * @brief Main loop that starts listening on the opened socket and dispatches new threads upon connection
- *          Only returns via upon receiving SIGINT or SIGTERM.
- * @return Returns 1 on successful cleanup, -1 on failure. Does not return without catching a signal to do so.
+ * Bounded accept queue feeding the worker pool. Multiple producers may push accepted (or resumed) connections
+ * and multiple workers pop them; a mutex and two condition variables keep it simple and portable.
  */
-int listenLoop()
+typedef struct accept_queue_s {
+    pool_conn_t *conns;
+    size_t capacity;
+    size_t head;        // Index of the oldest queued connection
+    size_t count;
+    bool closed;        // Set at shutdown; wakes and releases every waiter
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} accept_queue_t;
+
+accept_queue_t acceptQueue;
+
+/**
+ * @brief Allocates storage for a queue holding up to capacity connections
+ * @return 0 on success, -1 on failure.
+ */
+static int acceptQueueInit(accept_queue_t *q, size_t capacity)
 {
-    int rc = 0;
-    struct sockaddr_storage clientaddr;
-    int newfd = 0;
-    logfd = open(LOG_PATH, (O_APPEND | O_CREAT | O_RDWR), 0777);
-    if(logfd < 0){
-        perror("Could not open logfd");
+    memset(q, 0, sizeof(*q));
+    q->conns = malloc(sizeof(pool_conn_t) * capacity);
+    if(q->conns == NULL){
         return -1;
     }
+    q->capacity = capacity;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notEmpty, NULL);
+    pthread_cond_init(&q->notFull, NULL);
+    return 0;
+}
 
-    startIntervalLoggingTimer(); // Start once logFD is open
-
-    printf("starting to listen...\n");
-    rc = listen(sockfd, MAX_SOCK_CONNECTIONS);
-    if(rc == -1){
-        perror("listen failed");
-    }
-
-    int clientAddrSize = sizeof(clientaddr);
-    SLIST_INIT(&head); // Create LL for threadss
-
-    do
-    {
-        // accept is a blocking call. Execution will wait here for a connection
-        // printf("Main thread accepting new connections...\n");
-        syslog(LOG_DEBUG, "Main loop ready to accept new connection");
-        int clientfd = accept(sockfd, (sockaddr_t*) &clientaddr, &clientAddrSize);
-        if(clientfd == -1){
-            if(errno == EINTR && endProgram){
-                break;
-            } else {
-                perror("accept failed");
-            }
-        }
-        printClientNameConnected((sockaddr_t *) &clientaddr, clientAddrSize);
-        syslog(LOG_DEBUG, "New client - making new thread");
-
-        // Create new LinkedList node for the new pthread and give it the clientfd to act on
-        slist_data_t *newNode = NULL;
-        newNode = malloc(sizeof(slist_data_t));
-        memset(newNode, 0, sizeof(*newNode));
-        newNode->clientfd = clientfd;
-        SLIST_INSERT_HEAD(&head, newNode, entries);
-
-        // Create thread to respond to server request
-        pthread_create(&newNode->thread, NULL, repsondingThread, newNode);
-        if(newNode == NULL){
-            printf("Failed to make newNode in listenloop\n");
+/**
+ * @brief Queues conn for a worker. When the queue is full either waits for room (wait == true)
+ *          or returns immediately so the caller can reject the connection.
+ * @return 0 if queued, -1 if full (and not waiting) or closed.
+ */
+static int acceptQueuePush(accept_queue_t *q, const pool_conn_t *conn, bool wait)
+{
+    pthread_mutex_lock(&q->lock);
+    while(q->count == q->capacity && !q->closed){
+        if(!wait){
+            pthread_mutex_unlock(&q->lock);
             return -1;
         }
+        pthread_cond_wait(&q->notFull, &q->lock);
+    }
 
-        // Look to clean up any threads that are complete
-        slist_data_t* dataptr = NULL, *tmp = NULL;
-        SLIST_FOREACH_SAFE(dataptr, &head, entries, tmp){
-            if(atomic_load(&dataptr->isThreadComplete)){
-                SLIST_REMOVE(&head, dataptr, slist_data_s, entries);
-                pthread_join(dataptr->thread, NULL);
-                free(dataptr);
-
-            }
-        }
-
-    }while(!endProgram);
+    if(q->closed){
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
 
-    syslog(LOG_DEBUG, "Endprogram caught - cleaning up LL");
+    q->conns[(q->head + q->count) % q->capacity] = *conn;
+    q->count++;
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
 
-    // Program is ending. Clean up whole LL
-    slist_data_t* dataptr = NULL, *tmp = NULL;
-    SLIST_FOREACH_SAFE(dataptr, &head, entries, tmp){
-        SLIST_REMOVE(&head, dataptr, slist_data_s, entries);
-        pthread_join(dataptr->thread, NULL);
-        free(dataptr);
+/**
+ * @brief Blocks until a connection is available and dequeues it into conn
+ * @return false once the queue is closed and drained.
+ */
+static bool acceptQueuePop(accept_queue_t *q, pool_conn_t *conn)
+{
+    pthread_mutex_lock(&q->lock);
+    while(q->count == 0 && !q->closed){
+        pthread_cond_wait(&q->notEmpty, &q->lock);
     }
 
+    bool popped = q->count > 0;
+    if(popped){
+        *conn = q->conns[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->notFull);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return popped;
 }
 
 /**
- * @brief entry point for program
+ * @brief Marks the queue closed so workers exit once it is empty and producers stop waiting
+ */
+static void acceptQueueClose(accept_queue_t *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->notEmpty);
+    pthread_cond_broadcast(&q->notFull);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void acceptQueueDestroy(accept_queue_t *q)
+{
+    free(q->conns);
+    q->conns = NULL;
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->notEmpty);
+    pthread_cond_destroy(&q->notFull);
+}
+
+/**
+ * Keep-alive connections parked between packets. Workers park them; the shard 0 acceptor watches
+ * parkEpollFd next to its listener, queues them for a worker again once they are readable and closes
+ * the ones idle for keepAliveIdleSec. So a worker is only tied up while a packet is in flight.
+ */
+typedef struct parked_conn_s {
+    pool_conn_t conn;
+    time_t parkedAt;        // CLOCK_MONOTONIC seconds
+    LIST_ENTRY(parked_conn_s) entries;
+} parked_conn_t;
+
+LIST_HEAD(parked_conn_list, parked_conn_s);
+
+static int parkEpollFd = -1;
+static struct parked_conn_list parkedConns = LIST_HEAD_INITIALIZER(parkedConns);
+static pthread_mutex_t parkLock = PTHREAD_MUTEX_INITIALIZER; // Protects parkedConns
+
+/**
+ * @brief Parks an idle keep-alive connection until it has more to read
+ * @return 0 if parked, -1 if the caller must close it instead (shutting down, or out of resources).
+ */
+static int poolPark(const pool_conn_t *conn)
+{
+    if(parkEpollFd == -1 || endProgram){
+        return -1;
+    }
+    parked_conn_t *parked = malloc(sizeof(*parked));
+    if(parked == NULL){
+        return -1;
+    }
+    parked->conn = *conn;
+    parked->parkedAt = monotonicSec();
+
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = parked};
+    pthread_mutex_lock(&parkLock);
+    LIST_INSERT_HEAD(&parkedConns, parked, entries);
+    if(epoll_ctl(parkEpollFd, EPOLL_CTL_ADD, conn->fd, &ev) == -1){
+        perror("epoll_ctl park");
+        LIST_REMOVE(parked, entries);
+        pthread_mutex_unlock(&parkLock);
+        free(parked);
+        return -1;
+    }
+    pthread_mutex_unlock(&parkLock);
+    return 0;
+}
+
+/**
+ * @brief Takes parked off the parked list and the epoll set. Caller holds parkLock.
+ */
+static void poolUnpark(parked_conn_t *parked)
+{
+    LIST_REMOVE(parked, entries);
+    epoll_ctl(parkEpollFd, EPOLL_CTL_DEL, parked->conn.fd, NULL);
+}
+
+/**
+ * @brief Closes a connection that was taken off the parked list
+ */
+static void poolCloseParked(parked_conn_t *parked)
+{
+    shutdown(parked->conn.fd, SHUT_RDWR);
+    close(parked->conn.fd);
+    metrics_add(METRIC_CLOSES, 1);
+    free(parked);
+    DLOG(LOG_DEBUG, "Connection cleaned up");
+}
+
+/**
+ * @brief Queues every parked connection that has become readable for a worker. Shard 0 acceptor only.
+ */
+static void poolResumeParked()
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int n = epoll_wait(parkEpollFd, events, EPOLL_MAX_EVENTS, 0);
+    for(int i = 0; i < n; i++){
+        parked_conn_t *parked = events[i].data.ptr;
+        pthread_mutex_lock(&parkLock);
+        poolUnpark(parked);
+        pthread_mutex_unlock(&parkLock);
+
+        if(acceptQueuePush(&acceptQueue, &parked->conn, !rejectWhenSaturated) == -1){
+            DLOG(LOG_DEBUG, "Accept queue saturated - closing keep-alive connection");
+            poolCloseParked(parked);
+            continue;
+        }
+        free(parked);
+    }
+}
+
+/**
+ * @brief Closes parked connections idle for keepAliveIdleSec, or all of them with all set
+ */
+static void poolCloseIdleParked(bool all)
+{
+    time_t now = monotonicSec();
+    parked_conn_t *parked, *tmp;
+    pthread_mutex_lock(&parkLock);
+    LIST_FOREACH_SAFE(parked, &parkedConns, entries, tmp){
+        if(all || now - parked->parkedAt >= keepAliveIdleSec){
+            if(!all){
+                DLOG(LOG_DEBUG, "Keep-alive connection idle - closing");
+            }
+            poolUnpark(parked);
+            poolCloseParked(parked);
+        }
+    }
+    pthread_mutex_unlock(&parkLock);
+}
+
+/**
+ * @brief Pthread body of a pool worker. Serves queued connections until the queue is closed.
+ * @arg Unused
+ * @return None
+ */
+void* repsondingThread(void* arg)
+{
+    (void) arg;
+
+    DLOG(LOG_DEBUG, "New thread reporting for duty!");
+
+    pool_conn_t conn;
+    while(acceptQueuePop(&acceptQueue, &conn)){
+        handleConnection(&conn);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Pins thread to CPU (index modulo the online CPU count) when -c was given
+ */
+static void pinThreadForShard(pthread_t thread, int index)
+{
+    if(!pinShards){
+        return;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % (cpus > 0 ? cpus : 1), &set);
+    int rc = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if(rc != 0){
+        fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(rc));
+    }
+}
+
+/**
+ * @brief Creates the eventfd the signal handler uses to wake event loops and acceptors
+ * @return 0 on success, -1 on failure.
+ */
+static int openShutdownEventFd()
+{
+    if(shutdownEventFd == -1){
+        shutdownEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(shutdownEventFd == -1){
+            perror("eventfd");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Waits for a connection on listenfd, resuming parked keep-alive connections when parkfd (if not -1)
+ *          is readable meanwhile
+ * @return false once endProgram is set.
+ */
+static bool waitForConnection(int listenfd, int parkfd)
+{
+    struct pollfd fds[3] = {{.fd = listenfd, .events = POLLIN}, {.fd = shutdownEventFd, .events = POLLIN},
+                            {.fd = parkfd, .events = POLLIN}};
+    // Parked connections are checked for idleness once a second
+    int timeoutMs = parkfd == -1 ? -1 : 1000;
+    time_t lastSweep = monotonicSec();
+    while(!endProgram)
+    {
+        if(poll(fds, 3, timeoutMs) == -1){
+            if(errno != EINTR){
+                perror("poll listener");
+            }
+            continue;
+        }
+        if(fds[2].revents & POLLIN){
+            poolResumeParked();
+        }
+        if(parkfd != -1 && monotonicSec() != lastSweep){
+            poolCloseIdleParked(false);
+            lastSweep = monotonicSec();
+        }
+        if(fds[0].revents & POLLIN){
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Accept loop for one listener shard. Queues accepted connections for the worker pool until
+ *          endProgram is set. Shard 0 also watches the parked keep-alive connections.
+ * @arg Shard index, cast to a pointer
+ * @return None
+ */
+static void* shardAcceptThread(void* arg)
+{
+    int listenfd = listenFds[(intptr_t) arg];
+    int parkfd = (intptr_t) arg == 0 ? parkEpollFd : -1;
+    struct sockaddr_storage clientaddr;
+    socklen_t clientAddrSize;
+    do
+    {
+        // accept is a blocking call. Execution will wait here for a connection
+        DLOG(LOG_DEBUG, "Main loop ready to accept new connection");
+        if(!waitForConnection(listenfd, parkfd)){
+            break;
+        }
+        clientAddrSize = sizeof(clientaddr);
+        int clientfd = accept(listenfd, (sockaddr_t*) &clientaddr, &clientAddrSize);
+        if(clientfd == -1){
+            if(endProgram){
+                break;
+            } else {
+                perror("accept failed");
+                continue;
+            }
+        }
+        printClientNameConnected((sockaddr_t *) &clientaddr, clientAddrSize);
+        metrics_add(METRIC_ACCEPTS, 1);
+
+        pool_conn_t conn = {.fd = clientfd};
+        if(acceptQueuePush(&acceptQueue, &conn, !rejectWhenSaturated) == -1){
+            DLOG(LOG_DEBUG, "Accept queue saturated - rejecting connection");
+            close(clientfd);
+            metrics_add(METRIC_CLOSES, 1);
+        }
+
+    }while(!endProgram);
+
+    return NULL;
+}
+
+/**
+ * @brief Appends a timestamp each time the timer fires until endProgram is set. It has its own thread because
+ *          the acceptors block while the accept queue is full.
+ * @arg Unused
+ * @return None
+ */
+static void* poolTimestampThread(void* arg)
+{
+    (void) arg;
+    struct pollfd fds[2] = {{.fd = timestamp_fd(&timestampWriter), .events = POLLIN},
+                            {.fd = shutdownEventFd, .events = POLLIN}};
+    while(!endProgram)
+    {
+        if(poll(fds, 2, -1) == -1){
+            if(errno != EINTR){
+                perror("poll timestamp timer");
+            }
+            continue;
+        }
+        if(fds[0].revents & POLLIN){
+            timestamp_tick(&timestampWriter);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief On a handoff, gives the connections pool workers are serving HANDOFF_DRAIN_MS to finish, then
+ *          shuts down the rest so the workers can be joined
+ */
+static void poolDrain(void)
+{
+    pthread_mutex_lock(&inFlightLock);
+    poolDrainDeadline = monotonicMs() + HANDOFF_DRAIN_MS;
+    for(int i = 0; i < numInFlight; i++){
+        poolDrainLimit(inFlightFds[i]); // Bounds their next recv(); one already blocked waits for the deadline
+    }
+
+    while(numInFlight > 0 && monotonicMs() < poolDrainDeadline){
+        pthread_mutex_unlock(&inFlightLock);
+        poll(NULL, 0, 10);
+        pthread_mutex_lock(&inFlightLock);
+    }
+
+    if(numInFlight > 0){
+        DLOG(LOG_INFO, "Handoff drain deadline reached - dropping %d connections", numInFlight);
+        poolDrainExpired = true;
+        for(int i = 0; i < numInFlight; i++){
+            poolDrainLimit(inFlightFds[i]);
+        }
+    }
+    pthread_mutex_unlock(&inFlightLock);
+}
+
+/**
+ * @brief Serves connections with a fixed pool of numServeThreads workers, fed by one accept loop per
+ *          listener shard. The calling thread runs shard 0 until endProgram is set.
+ * @return Returns 1 on successful cleanup, -1 on failure.
+ */
+static int poolServe()
+{
+    // Acceptors wait on it next to their listener, so shutdown never has to touch the (possibly handed off)
+    // listening sockets
+    if(openShutdownEventFd() == -1){
+        return -1;
+    }
+    if(acceptQueueInit(&acceptQueue, acceptQueueDepth) == -1){
+        printf("Failed to alloc accept queue\n");
+        return -1;
+    }
+    if(keepAliveIdleSec > 0){
+        parkEpollFd = epoll_create1(EPOLL_CLOEXEC);
+        if(parkEpollFd == -1){
+            perror("epoll_create1 park");
+            acceptQueueDestroy(&acceptQueue);
+            return -1;
+        }
+    }
+
+    // Keep SIGINT/SIGTERM on the main thread so they interrupt its poll()
+    sigset_t blocked, previous;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+
+    pthread_t workers[MAX_SERVE_THREADS];
+    int started = 0;
+    for(int i = 0; i < numServeThreads; i++){
+        if(pthread_create(&workers[started], NULL, repsondingThread, NULL) != 0){
+            perror("pthread_create worker");
+            break;
+        }
+        started++;
+    }
+
+    pthread_t acceptors[MAX_LISTEN_SHARDS];
+    int shards = 1;
+    for(int i = 1; i < numListenFds && started > 0; i++){
+        if(pthread_create(&acceptors[shards], NULL, shardAcceptThread, (void*) (intptr_t) i) != 0){
+            perror("pthread_create acceptor");
+            break;
+        }
+        pinThreadForShard(acceptors[shards], i);
+        shards++;
+    }
+
+    pthread_t timestamper;
+    bool timestamping = false;
+    if(started > 0 && timestamp_fd(&timestampWriter) != -1){
+        if(pthread_create(&timestamper, NULL, poolTimestampThread, NULL) != 0){
+            perror("pthread_create timestamp");
+        } else {
+            timestamping = true;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if(started == 0){
+        acceptQueueDestroy(&acceptQueue);
+        close(parkEpollFd);
+        parkEpollFd = -1;
+        return -1;
+    }
+    DLOG(LOG_DEBUG, "Serving with %d pool workers, %d listener shards, queue depth %zu",
+            started, shards, acceptQueueDepth);
+
+    pinThreadForShard(pthread_self(), 0);
+    shardAcceptThread((void*) 0);
+
+    DLOG(LOG_DEBUG, "Endprogram caught - stopping workers");
+
+    // The shutdown eventfd has woken the other acceptors too
+    for(int i = 1; i < shards; i++){
+        pthread_join(acceptors[i], NULL);
+    }
+    if(timestamping){
+        pthread_join(timestamper, NULL);
+    }
+
+    // Workers finish what is already queued, then see the closed queue and exit
+    acceptQueueClose(&acceptQueue);
+    if(handingOff){
+        poolDrain();
+    }
+    for(int i = 0; i < started; i++){
+        pthread_join(workers[i], NULL);
+    }
+    acceptQueueDestroy(&acceptQueue);
+    // Serving may resume if the handoff fails
+    poolDrainDeadline = 0;
+    poolDrainExpired = false;
+
+    // Keep-alive clients between packets, like the event loops close them at shutdown or handoff
+    if(parkEpollFd != -1){
+        poolCloseIdleParked(true);
+        close(parkEpollFd);
+        parkEpollFd = -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Event-loop (epoll) serving model.
+ * Each loop thread owns an epoll instance watching the shared listening socket, the shutdown
+ * eventfd and every connection it accepted. Connections run the same recv -> append -> replay
+ * sequence as repsondingThread, but as a non-blocking state machine so one loop serves many clients.
+ */
+typedef enum {
+    CONN_STATE_RECV,    // Collecting bytes until a complete packet is buffered
+    CONN_STATE_REPLAY,  // Packet appended, streaming log bytes [replayOffset, replayEnd) back
+} conn_state_t;
+
+typedef struct epoll_conn_s {
+    int fd;
+    conn_state_t state;
+    uint8_t *buffer;
+    size_t bufferCapacity;
+    size_t totalBytesRecvd; // Bytes buffered and not yet appended
+    size_t scanned;         // Leading bytes of the buffer already searched for a newline
+    bool peerClosed;        // recv() returned EOF; finish what is buffered, then close
+    logstore_stage_t stage; // Leading part of an oversized packet
+    time_t lastActivity;    // CLOCK_MONOTONIC seconds of the last recv or replay progress, for timeouts
+    protocol_cursor_t cursor;
+    bool replayingCursorLine; // The replay in progress answers a cursor line, not a packet
+    uint64_t packetNs;      // When the packet being answered was appended, for the replay latency histogram
+    off_t replayOffset;
+    off_t replayEnd;
+    logstore_snapshot_t snapshot; // Ring bytes being replayed
+    LIST_ENTRY(epoll_conn_s) entries;
+} epoll_conn_t;
+
+LIST_HEAD(epoll_conn_list, epoll_conn_s);
+
+// Addresses used as epoll_event.data.ptr tags for the non-connection fds
+static int listenTag;
+static int shutdownTag;
+static int timerTag;
+
+/**
+ * @brief Sets O_NONBLOCK on fd
+ * @return 0 on success, -1 on failure.
+ */
+static int setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags == -1){
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * @brief Closes the connection and releases its state
+ */
+static void epollConnClose(int epfd, epoll_conn_t *conn)
+{
+    LIST_REMOVE(conn, entries);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    shutdown(conn->fd, SHUT_RDWR);
+    close(conn->fd);
+    metrics_add(METRIC_CLOSES, 1);
+    logstore_stage_close(&conn->stage);
+    logstore_snapshot_release(&conn->snapshot);
+    bufpool_put(conn->buffer);
+    free(conn);
+    DLOG(LOG_DEBUG, "Connection cleaned up");
+}
+
+/**
+ * @brief Appends the first len buffered bytes to the log as one packet and, if replay is set, records how
+ *          much of the log to replay. Bytes after the packet stay buffered for the next one.
+ */
+static void epollConnAppend(epoll_conn_t *conn, size_t len, bool replay)
+{
+    conn->packetNs = metrics_now_ns();
+    ssize_t end = appendPacket(&conn->stage, conn->buffer, len);
+    conn->replayEnd = end < 0 ? (off_t) logstore_size(&logStore) : end;
+
+    conn->totalBytesRecvd -= len;
+    if(conn->totalBytesRecvd == 0){
+        // Nothing pipelined behind this packet, don't hold the buffer through the replay
+        bufpool_put(conn->buffer);
+        conn->buffer = NULL;
+        conn->bufferCapacity = 0;
+    } else {
+        memmove(conn->buffer, conn->buffer + len, conn->totalBytesRecvd);
+    }
+    conn->scanned = 0;
+    if(!replay){
+        return;
+    }
+    conn->replayOffset = protocol_replay_start(&conn->cursor, logstore_start(&logStore));
+    conn->replayingCursorLine = false;
+    conn->lastActivity = monotonicSec();
+    conn->state = CONN_STATE_REPLAY;
+}
+
+/**
+ * @brief Consumes a replay cursor line at the start of the buffer and starts replaying the delta
+ * @return true if there was one.
+ */
+static bool epollConnCursorLine(epoll_conn_t *conn)
+{
+    if(conn->stage.len > 0){
+        return false; // Mid-packet, so not the start of a line
+    }
+
+    size_t logSize = logstore_size(&logStore);
+    size_t lineLen = protocol_apply_replay_from(&conn->cursor, conn->buffer, conn->totalBytesRecvd, logSize);
+    if(lineLen == 0){
+        return false;
+    }
+
+    conn->totalBytesRecvd -= lineLen;
+    memmove(conn->buffer, conn->buffer + lineLen, conn->totalBytesRecvd);
+    conn->scanned = 0;
+    conn->replayOffset = protocol_replay_start(&conn->cursor, logstore_start(&logStore));
+    conn->replayEnd = logSize;
+    conn->replayingCursorLine = true;
+    conn->lastActivity = monotonicSec();
+    conn->state = CONN_STATE_REPLAY;
+    return true;
+}
+
+/**
+ * @brief Drains the socket until EAGAIN (edge-triggered) or until a full packet is buffered
+ * @return 0 to keep the connection, -1 if it failed or has nothing left to do and must be closed.
+ */
+static int epollConnRecv(epoll_conn_t *conn)
+{
+    bool keepAlive = keepAliveIdleSec > 0;
+
+    while(conn->state == CONN_STATE_RECV)
+    {
+        if(epollConnCursorLine(conn)){
+            return 0;
+        }
+
+        // A pipelined packet may already be buffered behind the one just answered
+        size_t packetLen = framing_next_packet(conn->buffer, conn->totalBytesRecvd, &conn->scanned);
+        if(packetLen > 0){
+            if(packetTooLarge(conn->stage.len, packetLen)){
+                return -1;
+            }
+
+            // Same framing as repsondingThread: without keep-alive only the packet that ends the buffered
+            // bytes is answered
+            if(keepAlive || packetLen == conn->totalBytesRecvd){
+                epollConnAppend(conn, packetLen, true);
+                return 0;
+            }
+            epollConnAppend(conn, packetLen, false);
+            continue;
+        }
+
+        // Everything buffered is part of one unfinished packet
+        if(ingestPartialPacket(&conn->stage, conn->buffer, &conn->totalBytesRecvd, &conn->scanned) == -1){
+            return -1;
+        }
+
+        if(conn->peerClosed){
+            // Whatever is left is the final (unterminated) packet
+            if(keepAlive && conn->totalBytesRecvd == 0 && conn->stage.len == 0){
+                return -1;
+            }
+            epollConnAppend(conn, conn->totalBytesRecvd, true);
+            return 0;
+        }
+
+        if(conn->totalBytesRecvd == conn->bufferCapacity){
+            uint8_t *temp = bufpool_grow(conn->buffer, conn->totalBytesRecvd, conn->bufferCapacity + 1,
+                                         &conn->bufferCapacity);
+            if(temp == NULL){
+                printf("Failed to malloc large enough buffer.\n");
+                return -1;
+            }
+            conn->buffer = temp;
+        }
+
+        ssize_t n = recv(conn->fd, conn->buffer + conn->totalBytesRecvd,
+                         conn->bufferCapacity - conn->totalBytesRecvd, 0);
+        if(n < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return 0; // Wait for the next EPOLLIN edge
+            }
+            if(errno == EINTR){
+                continue;
+            }
+            perror("recv failed");
+            return -1;
+        }
+
+        if(n == 0){
+            conn->peerClosed = true;
+            continue;
+        }
+
+        conn->totalBytesRecvd += n;
+        conn->lastActivity = monotonicSec();
+        metrics_add(METRIC_BYTES_IN, n);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Sends as much of the pending replay as the socket accepts
+ * @return 1 when the replay is complete, 0 when waiting for EPOLLOUT, -1 on failure.
+ */
+static int epollConnReplay(epoll_conn_t *conn)
+{
+    while(conn->replayOffset < conn->replayEnd)
+    {
+        size_t len;
+        const char *chunk = logstore_replay_chunk(&logStore, &conn->snapshot, conn->replayOffset, conn->replayEnd,
+                                                  &len);
+        if(chunk == NULL){
+            DLOG(LOG_DEBUG, "Replay overtaken by log retention - dropping connection");
+            return -1;
+        }
+        ssize_t m = send(conn->fd, chunk, len, MSG_NOSIGNAL);
+        if(m < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return 0; // Socket buffer full, resume on the next EPOLLOUT edge
+            }
+            if(errno == EINTR){
+                continue;
+            }
+            perror("send");
+            return -1;
+        }
+        // Only advance by what the kernel took
+        conn->replayOffset += m;
+        conn->lastActivity = monotonicSec();
+        metrics_add(METRIC_BYTES_OUT, m);
+    }
+
+    logstore_snapshot_release(&conn->snapshot); // Don't hold it while the connection idles
+    return 1;
+}
+
+/**
+ * @brief Runs the connection state machine after an epoll event
+ */
+static void epollConnService(int epfd, epoll_conn_t *conn, uint32_t events)
+{
+    if(events & EPOLLERR){
+        epollConnClose(epfd, conn);
+        return;
+    }
+
+    while(1)
+    {
+        if(conn->state == CONN_STATE_RECV && epollConnRecv(conn) == -1){
+            epollConnClose(epfd, conn);
+            return;
+        }
+
+        if(conn->state == CONN_STATE_RECV){
+            return; // Waiting for more bytes
+        }
+
+        int rc = epollConnReplay(conn);
+        if(rc == 0){
+            return; // Waiting for EPOLLOUT
+        }
+
+        conn->cursor.offset = conn->replayEnd;
+        if(rc == 1 && !conn->replayingCursorLine){
+            metrics_observe(METRIC_HIST_REPLAY, metrics_now_ns() - conn->packetNs);
+        }
+
+        // Without keep-alive it's one packet per connection
+        if(rc == -1 || (keepAliveIdleSec == 0 && !conn->replayingCursorLine) ||
+           (conn->peerClosed && conn->totalBytesRecvd == 0)){
+            epollConnClose(epfd, conn);
+            return;
+        }
+
+        // Replay done, go back to reading; handles any packets the client pipelined meanwhile
+        conn->state = CONN_STATE_RECV;
+        conn->lastActivity = monotonicSec();
+    }
+}
+
+/**
+ * @brief Closes keep-alive connections that have waited for a packet longer than keepAliveIdleSec, and
+ *          connections whose replay has made no progress for stallDeadlineSec
+ */
+static void epollSweepTimeouts(int epfd, struct epoll_conn_list *conns)
+{
+    time_t now = monotonicSec();
+    epoll_conn_t *conn, *tmp;
+    LIST_FOREACH_SAFE(conn, conns, entries, tmp){
+        time_t quiet = now - conn->lastActivity;
+        if(conn->state == CONN_STATE_RECV && keepAliveIdleSec > 0 && quiet >= keepAliveIdleSec){
+            DLOG(LOG_DEBUG, "Keep-alive connection idle - closing");
+            epollConnClose(epfd, conn);
+        } else if(conn->state == CONN_STATE_REPLAY && stallDeadlineSec > 0 && quiet >= stallDeadlineSec){
+            DLOG(LOG_DEBUG, "Client stalled replay for %d s - dropping connection", stallDeadlineSec);
+            epollConnClose(epfd, conn);
+        }
+    }
+}
+
+/**
+ * @brief While draining for a handoff, closes keep-alive connections that sit between packets
+ */
+static void epollCloseIdle(int epfd, struct epoll_conn_list *conns)
+{
+    if(keepAliveIdleSec == 0){
+        return;
+    }
+
+    time_t now = monotonicSec();
+    epoll_conn_t *conn, *tmp;
+    LIST_FOREACH_SAFE(conn, conns, entries, tmp){
+        // A second of quiet, so a client that just connected still gets to send its packet
+        if(conn->state == CONN_STATE_RECV && conn->totalBytesRecvd == 0 && conn->stage.len == 0 &&
+           now - conn->lastActivity >= 1){
+            epollConnClose(epfd, conn);
+        }
+    }
+}
+
+/**
+ * @brief Accepts every pending connection on the listening socket and registers it with epfd
+ */
+static void epollAcceptAll(int epfd, int listenfd, struct epoll_conn_list *conns)
+{
+    struct sockaddr_storage clientaddr;
+
+    while(1)
+    {
+        socklen_t clientAddrSize = sizeof(clientaddr);
+        int clientfd = accept4(listenfd, (sockaddr_t*) &clientaddr, &clientAddrSize, SOCK_NONBLOCK);
+        if(clientfd == -1){
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                perror("accept failed");
+            }
+            return;
+        }
+        printClientNameConnected((sockaddr_t *) &clientaddr, clientAddrSize);
+        metrics_add(METRIC_ACCEPTS, 1);
+
+        epoll_conn_t *conn = calloc(1, sizeof(*conn));
+        if(conn == NULL){
+            printf("Failed to alloc connection in epollAcceptAll\n");
+            close(clientfd);
+            metrics_add(METRIC_CLOSES, 1);
+            continue;
+        }
+        conn->fd = clientfd;
+        conn->stage.fd = -1;
+        conn->state = CONN_STATE_RECV;
+        conn->lastActivity = monotonicSec();
+
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn};
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, clientfd, &ev) == -1){
+            perror("epoll_ctl add client");
+            close(clientfd);
+            metrics_add(METRIC_CLOSES, 1);
+            free(conn);
+            continue;
+        }
+        LIST_INSERT_HEAD(conns, conn, entries);
+
+        // Data may already be queued; edge-triggered mode will not report it again
+        epollConnService(epfd, conn, EPOLLIN);
+    }
+}
+
+/**
+ * @brief Pthread body of one event loop. Runs until endProgram is set.
+ * @arg Loop index, cast to a pointer. Loop i serves listener shard i modulo the shard count.
+ */
+static void* epollLoopThread(void* arg)
+{
+    int listenfd = listenFds[(intptr_t) arg % numListenFds];
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd == -1){
+        perror("epoll_create1");
+        return NULL;
+    }
+
+    // EPOLLEXCLUSIVE keeps a new connection from waking every loop at once
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &listenTag};
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) == -1){
+        perror("epoll_ctl add listener");
+        close(epfd);
+        return NULL;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &shutdownTag;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, shutdownEventFd, &ev) == -1){
+        perror("epoll_ctl add shutdown");
+        close(epfd);
+        return NULL;
+    }
+
+    // Loop 0 runs the timestamp timer
+    if((intptr_t) arg == 0 && timestamp_fd(&timestampWriter) != -1){
+        ev.data.ptr = &timerTag;
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, timestamp_fd(&timestampWriter), &ev) == -1){
+            perror("epoll_ctl add timer");
+            close(epfd);
+            return NULL;
+        }
+    }
+
+    struct epoll_conn_list conns = LIST_HEAD_INITIALIZER(conns);
+    // Idle and stall timeouts need a periodic wake to notice quiet connections
+    bool sweep = keepAliveIdleSec > 0 || stallDeadlineSec > 0;
+    int timeoutMs = sweep ? 1000 : -1;
+
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int64_t drainDeadline = 0;
+    while(1)
+    {
+        if(endProgram){
+            // On a handoff, finish the connections in flight before exiting, within HANDOFF_DRAIN_MS
+            if(!handingOff || (drainDeadline != 0 && monotonicMs() >= drainDeadline)){
+                break;
+            }
+            if(drainDeadline == 0){
+                // New clients wait in the listen backlog for the new process; the shutdown fd stays readable
+                epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, NULL);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, shutdownEventFd, NULL);
+                drainDeadline = monotonicMs() + HANDOFF_DRAIN_MS;
+            }
+            epollCloseIdle(epfd, &conns);
+            if(LIST_EMPTY(&conns)){
+                break;
+            }
+            // Wake at the deadline, not a sweep later
+            int64_t left = drainDeadline - monotonicMs();
+            timeoutMs = left > 0 ? (int) left : 0;
+        }
+
+        int n = epoll_wait(epfd, events, EPOLL_MAX_EVENTS, timeoutMs);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        for(int i = 0; i < n; i++){
+            if(events[i].data.ptr == &shutdownTag){
+                continue; // endProgram is already set, the top of the loop handles it
+            } else if(events[i].data.ptr == &listenTag){
+                epollAcceptAll(epfd, listenfd, &conns);
+            } else if(events[i].data.ptr == &timerTag){
+                timestamp_tick(&timestampWriter);
+            } else {
+                epollConnService(epfd, events[i].data.ptr, events[i].events);
+            }
+        }
+
+        if(sweep){
+            epollSweepTimeouts(epfd, &conns);
+        }
+    }
+
+    // Drop connections still open at shutdown (or past the drain deadline)
+    while(!LIST_EMPTY(&conns)){
+        epollConnClose(epfd, LIST_FIRST(&conns));
+    }
+    close(epfd);
+    return NULL;
+}
+
+/**
+ * @brief Serves connections with numServeThreads epoll threads. Returns once endProgram is set.
+ * @return Returns 1 on successful cleanup, -1 on failure.
+ */
+static int epollServe()
+{
+    if(openShutdownEventFd() == -1){
+        return -1;
+    }
+
+    for(int i = 0; i < numListenFds; i++){
+        if(setNonBlocking(listenFds[i]) == -1){
+            perror("set listener non-blocking");
+            return -1;
+        }
+    }
+
+    pthread_t loops[MAX_SERVE_THREADS];
+    int started = 0;
+    for(int i = 1; i < numServeThreads; i++){
+        if(pthread_create(&loops[started], NULL, epollLoopThread, (void*) (intptr_t) i) != 0){
+            perror("pthread_create event loop");
+            break;
+        }
+        pinThreadForShard(loops[started], i);
+        started++;
+    }
+
+    DLOG(LOG_DEBUG, "Serving with %d epoll loops on %d listeners", started + 1, numListenFds);
+    pinThreadForShard(pthread_self(), 0);
+    epollLoopThread((void*) 0); // The main thread is loop 0
+
+    for(int i = 0; i < started; i++){
+        pthread_join(loops[i], NULL);
+    }
+
+    return 0;
+}
+
+/**
+ * @return Loop count for the event loop models: -n, or the default, but at least one loop per listener shard
+ */
+static int eventLoopCount()
+{
+    int loops = numServeThreads ? numServeThreads : DEFAULT_EVENT_LOOPS;
+    return loops < numListenFds ? numListenFds : loops;
+}
+
+/**
+ * @brief Serves connections with the selected serving model until endProgram is set
+ * @return 0 once stopped, -1 on failure.
+ */
+static int serveConnections()
+{
+    int rc = 0;
+#ifdef USE_IO_URING
+    if(serveMode == SERVE_MODE_URING){
+        numServeThreads = eventLoopCount();
+        rc = openShutdownEventFd();
+        if(rc == 0){
+            uring_config_t config = {
+                .listenfds = listenFds,
+                .numListenfds = numListenFds,
+                .numRings = numServeThreads,
+                .pinRings = pinShards,
+                .store = &logStore,
+                .shutdownfd = shutdownEventFd,
+                .endProgram = &endProgram,
+                .keepAliveIdleSec = keepAliveIdleSec,
+                .spillThresholdBytes = spillThresholdBytes,
+                .maxPacketBytes = maxPacketBytes,
+                .stallDeadlineSec = stallDeadlineSec,
+                .timestamps = &timestampWriter,
+                .drainOnStop = &handingOff,
+                .drainMs = HANDOFF_DRAIN_MS,
+            };
+            rc = uring_serve(&config);
+        }
+        if(rc == URING_UNSUPPORTED){
+            DLOG(LOG_DEBUG, "io_uring not supported by this kernel - falling back to pool mode");
+            serveMode = SERVE_MODE_POOL;
+            numServeThreads = 0;
+        }
+    }
+#endif
+
+    if(serveMode == SERVE_MODE_EPOLL){
+        numServeThreads = eventLoopCount();
+        rc = epollServe();
+    } else if(serveMode == SERVE_MODE_POOL){
+        if(numServeThreads == 0){
+            numServeThreads = DEFAULT_POOL_WORKERS;
+        }
+        rc = poolServe();
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Sends the listeners and the log to the process that asked to take over. Connections are drained,
+ *          so nothing is appending: the log can change hands.
+ * @return 0 once the new process has them, -1 on failure (this process still owns everything).
+ */
+static int handOff()
+{
+    handoff_t handoff = {.numListenFds = numListenFds, .logFd = logStore.fd};
+    memcpy(handoff.listenFds, listenFds, numListenFds * sizeof(int));
+    timestamp_close(&timestampWriter);
+    int rc = -1;
+    if(logstore_export(&logStore, &handoff.log) == 0 && handoff_send(&handoff) == 0){
+        DLOG(LOG_INFO, "Handed off %d listeners and %zu log bytes", numListenFds, handoff.log.committed);
+        rc = 0;
+    }
+    free(handoff.log.segments);
+    return rc;
+}
+
+/**
+ * @brief After a failed handoff, undoes the stop so the serving model can run again on the same listeners
+ *          and log, and takes upgrade requests again
+ * @return 0 to serve again, -1 if a signal asked to exit meanwhile or the timestamps can't restart.
+ */
+static int resumeServing()
+{
+    DLOG(LOG_ERR, "Handoff failed - resuming service");
+
+    // Reset the eventfd before clearing the flags: a signal after this point sets them and writes it again
+    uint64_t count;
+    if(read(shutdownEventFd, &count, sizeof(count)) == -1 && errno != EAGAIN){
+        perror("read shutdown eventfd");
+    }
+    handingOff = 0;
+    endProgram = 0;
+    if(caughtSignal != 0){
+        endProgram = 1;
+        return -1;
+    }
+
+    if(timestamp_open(&timestampWriter, &logStore, timestampIntervalMs) == -1){
+        endProgram = 1;
+        return -1;
+    }
+    listenAll(MAX_SOCK_CONNECTIONS);
+    handoff_server_rearm();
+    return 0;
+}
+
+/**
+ * @brief Main loop that starts listening on the opened socket and dispatches connections to the serving mode
+ *          Only returns via upon receiving SIGINT or SIGTERM, or after handing off.
+ * @return Returns 0 on a clean shutdown or handoff, -1 on failure. Does not return without being asked to.
+ */
+int listenLoop()
+{
+    int rc = 0;
+    if(inherited.logFd != -1){
+        // Already mapped and indexed by the process we took over from; nothing to rebuild
+        rc = logstore_adopt(&logStore, inherited.logFd, LOG_PATH, LOGSTORE_EXTENT_BYTES, &inherited.log);
+        inherited.logFd = -1;
+        free(inherited.log.segments);
+        inherited.log.segments = NULL;
+    } else {
+        rc = logstore_open(&logStore, LOG_PATH, LOGSTORE_EXTENT_BYTES, &logRetention);
+    }
+    if(rc == -1){
+        return -1;
+    }
+    logStore.syncOnCommit = syncLogOnCommit;
+
+    // Start once the log store is open; loop 0 of the serving model appends on each tick
+    if(timestamp_open(&timestampWriter, &logStore, timestampIntervalMs) == -1){
+        return -1;
+    }
+
+    if(statsSocketPath != NULL && metrics_server_start(statsSocketPath) == -1){
+        return -1;
+    }
+
+    if(handoffPath != NULL && numListenFds > HANDOFF_MAX_LISTENERS){
+        printf("At most %d listener shards can be handed off\n", HANDOFF_MAX_LISTENERS);
+        return -1;
+    }
+    // The eventfd has to exist before a handoff request can arrive to write it
+    if(handoffPath != NULL && (openShutdownEventFd() == -1 || handoff_server_start(handoffPath, requestHandoff) == -1)){
+        return -1;
+    }
+
+    printf("starting to listen...\n");
+    listenAll(MAX_SOCK_CONNECTIONS);
+
+    while(true)
+    {
+        rc = serveConnections();
+        if(rc == -1 || !handingOff){
+            break;
+        }
+        if(handOff() == 0){
+            handedOff = true;
+            break;
+        }
+        if(resumeServing() == -1){
+            keepLog = true; // Exiting straight out of a failed handoff; the log was meant to outlive us
+            break;
+        }
+    }
+
+    if(caughtSignal == SIGINT || caughtSignal == SIGTERM){
+        DLOG(LOG_INFO, "Caught signal, exiting");
+    } else if(caughtSignal != 0){
+        DLOG(LOG_INFO, "Caught unknown signal %d. Exiting.", (int) caughtSignal);
+    }
+
+    logstore_stats_t stats;
+    logstore_get_stats(&logStore, &stats);
+    DLOG(LOG_DEBUG, "Log group commit: %llu packets in %llu batches (max %llu), flush avg %llu ns max %llu ns",
+            (unsigned long long) stats.packets, (unsigned long long) stats.batches,
+            (unsigned long long) stats.maxBatchPackets,
+            (unsigned long long) (stats.batches ? stats.flushNsTotal / stats.batches : 0),
+            (unsigned long long) stats.flushNsMax);
+    if(stats.droppedBytes > 0){
+        DLOG(LOG_DEBUG, "Log retention dropped %llu bytes", (unsigned long long) stats.droppedBytes);
+    }
+
+    bufpool_stats_t poolStats;
+    bufpool_get_stats(&poolStats);
+    DLOG(LOG_DEBUG, "Receive buffer pool: %llu hits, %llu misses, %llu oversize",
+            (unsigned long long) poolStats.hits, (unsigned long long) poolStats.misses,
+            (unsigned long long) poolStats.oversize);
+
+    return rc;
+}
+
+/**
+ * @brief entry point for program
  */
 int main(int argc, char ** argv){
 
-    if(argc == 2)
+    int opt;
+    while((opt = getopt(argc, argv, "a:b:cde:fH:i:k:l:m:n:p:q:rs:t:v:w:")) != -1)
     {
-        if (strcmp(argv[1], "-d") == 0){
+        switch(opt){
+        case 'a':
+            logRetention.maxAgeSec = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            logRetention.maxBytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            pinShards = true;
+            break;
+        case 'd':
             runAsDaemon = true;
+            break;
+        case 'e':
+            logRetention.maxRecords = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            syncLogOnCommit = true;
+            break;
+        case 'H':
+            handoffPath = optarg;
+            break;
+        case 'i':
+            timestampIntervalMs = atoi(optarg);
+            if(atoi(optarg) < 1){
+                printf("Timestamp interval must be at least 1 ms\n");
+                return -1;
+            }
+            break;
+        case 'k':
+            keepAliveIdleSec = atoi(optarg);
+            if(keepAliveIdleSec < 1){
+                printf("Keep-alive idle timeout must be at least 1 second\n");
+                return -1;
+            }
+            break;
+        case 'l':
+            maxPacketBytes = strtoull(optarg, NULL, 10);
+            if(maxPacketBytes < 1){
+                printf("Packet size limit must be at least 1 byte\n");
+                return -1;
+            }
+            break;
+        case 'm':
+            if(strcmp(optarg, "pool") == 0){
+                serveMode = SERVE_MODE_POOL;
+            } else if(strcmp(optarg, "epoll") == 0){
+                serveMode = SERVE_MODE_EPOLL;
+            } else if(strcmp(optarg, "uring") == 0){
+#ifdef USE_IO_URING
+                serveMode = SERVE_MODE_URING;
+#else
+                printf("Built without io_uring support (make USE_IO_URING=1), using pool mode\n");
+                serveMode = SERVE_MODE_POOL;
+#endif
+            } else {
+                printf("Unknown serving mode %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'n':
+            numServeThreads = atoi(optarg);
+            if(numServeThreads < 1 || numServeThreads > MAX_SERVE_THREADS){
+                printf("Thread count must be 1-%d\n", MAX_SERVE_THREADS);
+                return -1;
+            }
+            break;
+        case 'p':
+            statsSocketPath = optarg;
+            break;
+        case 'q':
+            if(atoi(optarg) < 1){
+                printf("Accept queue depth must be at least 1\n");
+                return -1;
+            }
+            acceptQueueDepth = atoi(optarg);
+            break;
+        case 'r':
+            rejectWhenSaturated = true;
+            break;
+        case 's':
+            numListenShards = atoi(optarg);
+            if(numListenShards == 0){
+                numListenShards = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            if(numListenShards < 1 || numListenShards > MAX_LISTEN_SHARDS){
+                printf("Listener shard count must be 0-%d\n", MAX_LISTEN_SHARDS);
+                return -1;
+            }
+            break;
+        case 't':
+            spillThresholdBytes = strtoull(optarg, NULL, 10);
+            if(spillThresholdBytes < 1){
+                printf("Spill threshold must be at least 1 byte\n");
+                return -1;
+            }
+            break;
+        case 'v':
+            if(atoi(optarg) < LOG_EMERG || atoi(optarg) > LOG_DEBUG){
+                printf("Log level must be a syslog priority, %d-%d\n", LOG_EMERG, LOG_DEBUG);
+                return -1;
+            }
+            dlog_set_level(atoi(optarg));
+            break;
+        case 'w':
+            stallDeadlineSec = atoi(optarg);
+            if(stallDeadlineSec < 0){
+                printf("Stall deadline must be 0 (never) or more seconds\n");
+                return -1;
+            }
+            break;
+        default:
+            printf("Bad args to aesdsocket\n");
+            printf("Usage: %s [-a retain_sec] [-b retain_bytes] [-e retain_records] [-d] [-f] [-H handoff_socket] [-i timestamp_ms] [-k idle_sec] [-l max_packet_bytes] [-m pool|epoll|uring] [-n threads] [-p stats_socket] [-q queue_depth] [-r] [-s shards] [-c] [-t spill_bytes] [-v log_level] [-w stall_sec]\n", argv[0]);
+            return -1;
         }
-    } else if(argc != 1){
+    }
+
+    if(optind != argc){
         printf("Bad args to aesdsocket\n");
         return -1;
     }
 
+    if(handoffPath != NULL){
+        // Take over from a running aesdsocket if there is one; this waits while it drains
+        int handoffRc = handoff_receive(handoffPath, &inherited);
+        if(handoffRc == -1){
+            return -1;
+        }
+        if(handoffRc == 1){
+            // The log keeps the retention policy it was built with
+            logRetention = inherited.log.retention;
+            numListenFds = inherited.numListenFds;
+            memcpy(listenFds, inherited.listenFds, numListenFds * sizeof(int));
+            for(int i = 0; i < numListenFds; i++){
+                // O_NONBLOCK is shared with the old process's open file; start from a blocking listener
+                fcntl(listenFds[i], F_SETFL, fcntl(listenFds[i], F_GETFL) & ~O_NONBLOCK);
+            }
+        }
+    }
+
+    if(logRetention.maxBytes || logRetention.maxRecords || logRetention.maxAgeSec){
+        // A packet bigger than the retention window could never be kept; refuse it before buffering it
+        size_t windowBytes = logRetention.maxBytes ? logRetention.maxBytes : LOGSTORE_DEFAULT_RETAIN_BYTES;
+        if(maxPacketBytes > windowBytes){
+            maxPacketBytes = windowBytes;
+        }
+    }
+
     openlog("aesdsocket", LOG_PERROR, LOG_USER);
     struct sigaction sa = {0};
     sa.sa_handler = handle_sigint;
@@ -529,21 +2111,30 @@ int main(int argc, char ** argv){
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
 
-    // open a socket on port 9000
-    int rc = openSocket(SOCKET_PORT);
+    // kill -USR1 / -USR2 turn logging up / down at runtime
+    sa.sa_handler = dlog_signal_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
 
-    // Now init mutex to procet the log data
-    rc = pthread_mutex_init(&logMutex, NULL);
-    if(rc == -1){
-        perror("mutex create failed");
-    }    
+    // A client hanging up mid-replay must not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    // open a socket on port 9000, unless listeners were handed over
+    int rc = numListenFds > 0 ? 0 : openSocket(SOCKET_PORT);
+    if(rc == 0){
+        rc = daemonize();
+    }
 
     // Listen for and accept new connection
-    if(rc == 0)
+    if(rc == 0){
+        dlog_start(); // After the daemon fork, which would leave the drainer thread behind. On failure messages
+                      // go to syslog synchronously.
         rc = listenLoop();
+    }
 
     cleanupProgram();
 
-    syslog(LOG_DEBUG, "socketserver closing");
+    DLOG(LOG_DEBUG, "socketserver closing");
+    dlog_stop();
     return rc;
 }
\ No newline at end of file
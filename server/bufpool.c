@@ -0,0 +1,236 @@
+/**
+ * @file bufpool.c
+ * @brief Per-thread, size-classed receive buffer pools. See bufpool.h.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "bufpool.h"
+#include "queue.h"
+
+#define BUFPOOL_CLASS_OVERSIZE (BUFPOOL_NUM_CLASSES)
+
+/**
+ * Sits in front of every buffer handed out. Kept max_align_t sized so the payload stays aligned.
+ */
+typedef union bufpool_header_u {
+    struct {
+        unsigned sizeClass;             // BUFPOOL_CLASS_OVERSIZE for direct mallocs
+        size_t capacity;
+        union bufpool_header_u *next;   // Free list link while cached
+    };
+    max_align_t align;
+} bufpool_header_t;
+
+typedef struct bufpool_thread_s {
+    bufpool_header_t *freeList[BUFPOOL_NUM_CLASSES];
+    unsigned cached[BUFPOOL_NUM_CLASSES];
+    // Only the owning thread writes these; bufpool_get_stats reads them from other threads
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t oversize;
+    LIST_ENTRY(bufpool_thread_s) entries;
+} bufpool_thread_t;
+
+static pthread_once_t poolKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t poolKey;
+static _Thread_local bufpool_thread_t *threadPool;
+
+// Registry of live thread pools plus the totals of exited threads, for bufpool_get_stats
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(bufpool_thread_list, bufpool_thread_s) livePools = LIST_HEAD_INITIALIZER(livePools);
+static bufpool_stats_t exitedTotals;
+
+static inline size_t classBytes(unsigned sizeClass)
+{
+    return (size_t) BUFPOOL_MIN_BYTES << (BUFPOOL_CLASS_GROWTH_SHIFT * sizeClass);
+}
+
+static inline unsigned classMaxCached(unsigned sizeClass)
+{
+    size_t count = BUFPOOL_CLASS_CACHE_BYTES / classBytes(sizeClass);
+    return count ? count : 1;
+}
+
+/**
+ * @return Smallest class holding minBytes, or BUFPOOL_CLASS_OVERSIZE
+ */
+static unsigned classFor(size_t minBytes)
+{
+    for(unsigned c = 0; c < BUFPOOL_NUM_CLASSES; c++){
+        if(minBytes <= classBytes(c)){
+            return c;
+        }
+    }
+    return BUFPOOL_CLASS_OVERSIZE;
+}
+
+static inline void counterInc(_Atomic uint64_t *counter)
+{
+    // Single writer, so a relaxed load + store is enough and avoids a locked instruction
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Thread exit destructor: frees the cached buffers and folds the counters into exitedTotals
+ */
+static void threadPoolDestroy(void *arg)
+{
+    bufpool_thread_t *pool = arg;
+
+    for(unsigned c = 0; c < BUFPOOL_NUM_CLASSES; c++){
+        while(pool->freeList[c] != NULL){
+            bufpool_header_t *h = pool->freeList[c];
+            pool->freeList[c] = h->next;
+            free(h);
+        }
+    }
+
+    pthread_mutex_lock(&registryLock);
+    LIST_REMOVE(pool, entries);
+    exitedTotals.hits += atomic_load(&pool->hits);
+    exitedTotals.misses += atomic_load(&pool->misses);
+    exitedTotals.oversize += atomic_load(&pool->oversize);
+    pthread_mutex_unlock(&registryLock);
+
+    free(pool);
+    threadPool = NULL;
+}
+
+static void poolKeyCreate(void)
+{
+    pthread_key_create(&poolKey, threadPoolDestroy);
+}
+
+/**
+ * @return This thread's pool, created on first use, or NULL if it couldn't be allocated
+ */
+static bufpool_thread_t *threadPoolGet(void)
+{
+    if(threadPool != NULL){
+        return threadPool;
+    }
+
+    pthread_once(&poolKeyOnce, poolKeyCreate);
+    bufpool_thread_t *pool = calloc(1, sizeof(*pool));
+    if(pool == NULL){
+        return NULL;
+    }
+
+    pthread_mutex_lock(&registryLock);
+    LIST_INSERT_HEAD(&livePools, pool, entries);
+    pthread_mutex_unlock(&registryLock);
+
+    pthread_setspecific(poolKey, pool);
+    threadPool = pool;
+    return pool;
+}
+
+void *bufpool_get(size_t minBytes, size_t *capacity)
+{
+    bufpool_thread_t *pool = threadPoolGet();
+    unsigned sizeClass = classFor(minBytes);
+    bufpool_header_t *h;
+
+    if(sizeClass == BUFPOOL_CLASS_OVERSIZE){
+        h = malloc(sizeof(*h) + minBytes);
+        if(h == NULL){
+            return NULL;
+        }
+        h->capacity = minBytes;
+        if(pool != NULL){
+            counterInc(&pool->oversize);
+        }
+    } else if(pool != NULL && pool->freeList[sizeClass] != NULL){
+        h = pool->freeList[sizeClass];
+        pool->freeList[sizeClass] = h->next;
+        pool->cached[sizeClass]--;
+        counterInc(&pool->hits);
+    } else {
+        h = malloc(sizeof(*h) + classBytes(sizeClass));
+        if(h == NULL){
+            return NULL;
+        }
+        h->capacity = classBytes(sizeClass);
+        if(pool != NULL){
+            counterInc(&pool->misses);
+        }
+    }
+
+    h->sizeClass = sizeClass;
+    h->next = NULL;
+    *capacity = h->capacity;
+    return h + 1;
+}
+
+void *bufpool_grow(void *buf, size_t used, size_t minBytes, size_t *capacity)
+{
+    if(buf != NULL && minBytes <= *capacity){
+        return buf;
+    }
+
+    // Oversize buffers stay oversize, so let realloc extend them in place when it can
+    if(buf != NULL && minBytes > BUFPOOL_MAX_POOLED_BYTES){
+        bufpool_header_t *h = (bufpool_header_t *) buf - 1;
+        if(h->sizeClass == BUFPOOL_CLASS_OVERSIZE){
+            // Double so a huge packet still only costs O(log n) reallocs
+            size_t newCapacity = minBytes > 2 * h->capacity ? minBytes : 2 * h->capacity;
+            bufpool_header_t *temp = realloc(h, sizeof(*h) + newCapacity);
+            if(temp == NULL){
+                return NULL;
+            }
+            temp->capacity = newCapacity;
+            *capacity = newCapacity;
+            return temp + 1;
+        }
+    }
+
+    size_t newCapacity;
+    void *newBuf = bufpool_get(minBytes, &newCapacity);
+    if(newBuf == NULL){
+        return NULL;
+    }
+    if(buf != NULL){
+        memcpy(newBuf, buf, used);
+        bufpool_put(buf);
+    }
+    *capacity = newCapacity;
+    return newBuf;
+}
+
+void bufpool_put(void *buf)
+{
+    if(buf == NULL){
+        return;
+    }
+
+    bufpool_header_t *h = (bufpool_header_t *) buf - 1;
+    bufpool_thread_t *pool = threadPoolGet();
+    unsigned sizeClass = h->sizeClass;
+
+    if(sizeClass == BUFPOOL_CLASS_OVERSIZE || pool == NULL || pool->cached[sizeClass] >= classMaxCached(sizeClass)){
+        free(h);
+        return;
+    }
+
+    h->next = pool->freeList[sizeClass];
+    pool->freeList[sizeClass] = h;
+    pool->cached[sizeClass]++;
+}
+
+void bufpool_get_stats(bufpool_stats_t *stats)
+{
+    pthread_mutex_lock(&registryLock);
+    *stats = exitedTotals;
+    bufpool_thread_t *pool;
+    LIST_FOREACH(pool, &livePools, entries){
+        stats->hits += atomic_load_explicit(&pool->hits, memory_order_relaxed);
+        stats->misses += atomic_load_explicit(&pool->misses, memory_order_relaxed);
+        stats->oversize += atomic_load_explicit(&pool->oversize, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&registryLock);
+}
@@ -0,0 +1,68 @@
+/*
+ * bufpool.h
+ *
+ * Receive buffer pools for aesdsocket connections.
+ *
+ * Buffers come in size classes, each BUFPOOL_CLASS_GROWTH times the last,
+ * from BUFPOOL_MIN_BYTES up to BUFPOOL_MAX_POOLED_BYTES. Every thread keeps
+ * its own free list per class, so getting and returning a buffer is a few
+ * pointer moves with no locking and no trip to the general-purpose allocator
+ * once the lists are warm. Each list holds at most BUFPOOL_CLASS_CACHE_BYTES
+ * (and at least one buffer); beyond that returned buffers are freed.
+ *
+ * Growing a buffer moves to the next class, so a 1 MB packet is copied four
+ * times instead of being realloc'd from 32 bytes up. Requests above the
+ * largest class fall through to malloc/realloc and are counted as oversize.
+ *
+ * A buffer may be returned on a different thread than the one it came from;
+ * it just joins that thread's lists. A thread's cached buffers are freed when
+ * it exits.
+ */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUFPOOL_MIN_BYTES (4096)
+#define BUFPOOL_CLASS_GROWTH_SHIFT (2) // Each class is 4x the one below
+#define BUFPOOL_NUM_CLASSES (6)        // 4 KB, 16 KB, 64 KB, 256 KB, 1 MB, 4 MB
+#define BUFPOOL_MAX_POOLED_BYTES ((size_t) BUFPOOL_MIN_BYTES << (BUFPOOL_CLASS_GROWTH_SHIFT * (BUFPOOL_NUM_CLASSES - 1)))
+#define BUFPOOL_CLASS_CACHE_BYTES (1024 * 1024)
+
+/**
+ * Counters summed over every thread, since start
+ */
+typedef struct bufpool_stats_s {
+    uint64_t hits;      // Served from a thread's free list
+    uint64_t misses;    // Pooled class, but the free list was empty so it was malloc'd
+    uint64_t oversize;  // Larger than the largest class, malloc'd and freed directly
+} bufpool_stats_t;
+
+/**
+ * @brief Gets a buffer of at least minBytes
+ * @arg capacity set to the usable size of the returned buffer
+ * @return The buffer, or NULL if memory ran out.
+ */
+void *bufpool_get(size_t minBytes, size_t *capacity);
+
+/**
+ * @brief Replaces buf with a buffer of at least minBytes holding the same first used bytes, like realloc.
+ *          buf may be NULL.
+ * @arg capacity in: buf's capacity, out: the new buffer's capacity
+ * @return The new buffer, or NULL (buf is left untouched) if memory ran out.
+ */
+void *bufpool_grow(void *buf, size_t used, size_t minBytes, size_t *capacity);
+
+/**
+ * @brief Returns a buffer from bufpool_get or bufpool_grow. NULL is ignored.
+ */
+void bufpool_put(void *buf);
+
+/**
+ * @brief Sums the counters of all threads, live and exited
+ */
+void bufpool_get_stats(bufpool_stats_t *stats);
+
+#endif /* BUFPOOL_H */
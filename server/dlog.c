@@ -0,0 +1,236 @@
+/**
+ * @file dlog.c
+ * @brief Lock-free ring of log messages drained to syslog by one thread. See dlog.h.
+ *
+ */
+
+#define _GNU_SOURCE // CLOCK_MONOTONIC_COARSE
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "dlog.h"
+
+#define DLOG_RING_SLOTS (1024) // Must be a power of two
+#define DLOG_MSG_BYTES (256)   // Longer messages are truncated
+
+/**
+ * A slot is free for the producer claiming position pos when seq == pos, and holds a message for the
+ * drainer at position pos when seq == pos + 1
+ */
+typedef struct dlog_slot_s {
+    _Atomic uint64_t seq;
+    int level;
+    char msg[DLOG_MSG_BYTES];
+} dlog_slot_t;
+
+_Atomic int dlogLevel = LOG_INFO; // Per-connection debug messages stay off unless -v 7 or SIGUSR1
+
+static dlog_slot_t ring[DLOG_RING_SLOTS];
+static _Atomic uint64_t ringTail;   // Next position producers claim
+static uint64_t ringHead;           // Next position the drainer reads; drainer only
+static _Atomic uint64_t dropped;    // Messages lost to a full ring
+
+static pthread_t drainer;
+static _Atomic bool running;
+static _Atomic bool stopping;
+static _Atomic bool drainerSleeping;
+static int wakeFd = -1;
+
+/**
+ * @brief Formats a message into the next free slot and publishes it; drops it if the ring is full
+ */
+static void dlogEnqueue(int level, const char *fmt, va_list ap)
+{
+    if(!atomic_load_explicit(&running, memory_order_acquire)){
+        vsyslog(level, fmt, ap);
+        return;
+    }
+
+    uint64_t pos = atomic_load_explicit(&ringTail, memory_order_relaxed);
+    dlog_slot_t *slot;
+    while(1)
+    {
+        slot = &ring[pos & (DLOG_RING_SLOTS - 1)];
+        int64_t diff = (int64_t) (atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+        if(diff == 0){
+            if(atomic_compare_exchange_weak_explicit(&ringTail, &pos, pos + 1, memory_order_relaxed,
+                                                     memory_order_relaxed)){
+                break;
+            }
+        } else if(diff < 0){
+            // The drainer hasn't freed this slot yet: the ring is full
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&ringTail, memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    // Pairs with the fence in the drainer: either it sees this slot or we see it sleeping
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&drainerSleeping, memory_order_relaxed) &&
+       atomic_exchange(&drainerSleeping, false)){
+        uint64_t one = 1;
+        write(wakeFd, &one, sizeof(one));
+    }
+}
+
+static void dlogEnqueuef(int level, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    dlogEnqueue(level, fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * @brief Hands every published message to syslog
+ * @return false if the ring was empty.
+ */
+static bool dlogDrain(void)
+{
+    bool any = false;
+    while(1)
+    {
+        dlog_slot_t *slot = &ring[ringHead & (DLOG_RING_SLOTS - 1)];
+        if(atomic_load_explicit(&slot->seq, memory_order_acquire) != ringHead + 1){
+            return any;
+        }
+        syslog(slot->level, "%s", slot->msg);
+        atomic_store_explicit(&slot->seq, ringHead + DLOG_RING_SLOTS, memory_order_release);
+        ringHead++;
+        any = true;
+    }
+}
+
+static void* dlogDrainerThread(void* arg)
+{
+    (void) arg;
+
+    // Signals belong to the serving threads
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    while(!atomic_load(&stopping))
+    {
+        if(dlogDrain()){
+            continue;
+        }
+
+        atomic_store(&drainerSleeping, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if(dlogDrain() || atomic_load(&stopping)){
+            atomic_store(&drainerSleeping, false);
+            continue;
+        }
+
+        uint64_t wakes;
+        if(read(wakeFd, &wakes, sizeof(wakes)) == -1 && errno != EINTR){
+            perror("read dlog wake");
+            break;
+        }
+    }
+
+    dlogDrain();
+    return NULL;
+}
+
+void dlog_write(dlog_site_t *site, int level, const char *fmt, ...)
+{
+    // Coarse clock: a vDSO read with no syscall, and a one second window doesn't need more
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    int64_t now = ts.tv_sec;
+
+    int64_t window = atomic_load_explicit(&site->windowSec, memory_order_relaxed);
+    if(now != window && atomic_compare_exchange_strong(&site->windowSec, &window, now)){
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+        uint32_t suppressed = atomic_exchange(&site->suppressed, 0);
+        if(suppressed > 0){
+            dlogEnqueuef(LOG_NOTICE, "%u messages suppressed from %s:%d", suppressed, site->file, site->line);
+        }
+    }
+
+    if(atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) >= DLOG_SITE_BURST){
+        atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    dlogEnqueue(level, fmt, ap);
+    va_end(ap);
+}
+
+void dlog_set_level(int level)
+{
+    if(level < LOG_EMERG){
+        level = LOG_EMERG;
+    } else if(level > LOG_DEBUG){
+        level = LOG_DEBUG;
+    }
+    atomic_store(&dlogLevel, level);
+}
+
+void dlog_signal_handler(int sig)
+{
+    int level = atomic_load(&dlogLevel);
+    dlog_set_level(sig == SIGUSR1 ? level + 1 : level - 1);
+}
+
+int dlog_start(void)
+{
+    for(size_t i = 0; i < DLOG_RING_SLOTS; i++){
+        atomic_init(&ring[i].seq, i);
+    }
+
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    if(wakeFd == -1){
+        perror("dlog eventfd");
+        return -1;
+    }
+    if(pthread_create(&drainer, NULL, dlogDrainerThread, NULL) != 0){
+        perror("pthread_create dlog drainer");
+        close(wakeFd);
+        wakeFd = -1;
+        return -1;
+    }
+    atomic_store_explicit(&running, true, memory_order_release);
+    return 0;
+}
+
+void dlog_stop(void)
+{
+    if(!atomic_load(&running)){
+        return;
+    }
+
+    // New messages go straight to syslog from here on; the drainer empties the ring before exiting
+    atomic_store(&running, false);
+    atomic_store(&stopping, true);
+    uint64_t one = 1;
+    write(wakeFd, &one, sizeof(one));
+    pthread_join(drainer, NULL);
+
+    // Producers that claimed a slot just before running went false
+    dlogDrain();
+    close(wakeFd);
+    wakeFd = -1;
+
+    uint64_t lost = atomic_load(&dropped);
+    if(lost > 0){
+        syslog(LOG_NOTICE, "%llu log messages dropped with the log ring full", (unsigned long long) lost);
+    }
+}
@@ -0,0 +1,87 @@
+/*
+ * dlog.h
+ *
+ * Asynchronous syslog for aesdsocket.
+ *
+ * DLOG() first compares the level with the runtime threshold, so a disabled
+ * level costs one relaxed load and the arguments are never evaluated. An
+ * enabled message is rate limited per call site (DLOG_SITE_BURST per second,
+ * with a count of what was suppressed reported afterwards), formatted straight
+ * into a slot of a fixed-size lock-free ring, and handed to syslog() by a
+ * background drainer thread. Messages are truncated to the slot size; if the
+ * ring is full the message is dropped and counted rather than blocking the
+ * caller. Before dlog_start() and after dlog_stop() messages go straight to
+ * syslog().
+ *
+ * The threshold starts at LOG_INFO and is set with dlog_set_level(); SIGUSR1
+ * and SIGUSR2 (see dlog_signal_handler) raise and lower it one syslog priority
+ * at a time.
+ */
+
+#ifndef DLOG_H
+#define DLOG_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <syslog.h>
+
+#define DLOG_SITE_BURST (100)   // Messages per call site per second
+#define DLOG_PAYLOAD_BYTES (64) // Longest client payload excerpt worth logging
+
+/**
+ * Rate limit state for one DLOG() call site
+ */
+typedef struct dlog_site_s {
+    const char *file;
+    int line;
+    _Atomic int64_t windowSec;
+    _Atomic uint32_t count;
+    _Atomic uint32_t suppressed;
+} dlog_site_t;
+
+extern _Atomic int dlogLevel;
+
+/**
+ * @return true if messages at level (a syslog priority) are currently logged
+ */
+static inline bool dlog_enabled(int level)
+{
+    return level <= atomic_load_explicit(&dlogLevel, memory_order_relaxed);
+}
+
+/**
+ * @brief Logs a message at level (a syslog priority) without blocking on syslog
+ */
+#define DLOG(level, ...) \
+    do { \
+        if(dlog_enabled(level)){ \
+            static dlog_site_t dlogSite_ = {.file = __FILE__, .line = __LINE__}; \
+            dlog_write(&dlogSite_, (level), __VA_ARGS__); \
+        } \
+    } while(0)
+
+void dlog_write(dlog_site_t *site, int level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+/**
+ * @brief Sets the threshold: messages at level or more severe are logged. Safe from signal handlers.
+ */
+void dlog_set_level(int level);
+
+/**
+ * @brief SIGUSR1 raises the threshold (more verbose), SIGUSR2 lowers it
+ */
+void dlog_signal_handler(int sig);
+
+/**
+ * @brief Starts the drainer thread
+ * @return 0 on success, -1 on failure (messages keep going straight to syslog).
+ */
+int dlog_start(void);
+
+/**
+ * @brief Drains what is queued, stops the drainer thread and logs how many messages were dropped
+ */
+void dlog_stop(void);
+
+#endif /* DLOG_H */
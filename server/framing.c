@@ -0,0 +1,158 @@
+/**
+ * @file framing.c
+ * @brief Newline search and packet splitting for aesdsocket. See framing.h.
+ *
+ */
+
+#include <string.h>
+#include <stdatomic.h>
+
+#include "framing.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define FRAMING_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Portable search, eight bytes per step using the "has zero byte" trick
+ */
+static const uint8_t *findNewlineScalar(const uint8_t *data, size_t len)
+{
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t highs = 0x8080808080808080ull;
+    const uint64_t newlines = ones * '\n';
+    size_t i = 0;
+
+    for(; i + 8 <= len; i += 8){
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word)); // Unaligned-safe load
+        word ^= newlines; // Newline bytes become zero
+        if((word - ones) & ~word & highs){
+            break; // A newline is in this word; the byte loop below finds which
+        }
+    }
+
+    for(; i < len; i++){
+        if(data[i] == '\n'){
+            return data + i;
+        }
+    }
+    return NULL;
+}
+
+#ifdef FRAMING_HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static const uint8_t *findNewlineSse2(const uint8_t *data, size_t len)
+{
+    const __m128i newlines = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for(; i + 16 <= len; i += 16){
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newlines));
+        if(mask != 0){
+            return data + i + __builtin_ctz(mask);
+        }
+    }
+
+    if(i < len && len >= 16){
+        // One overlapping load covers the tail
+        size_t last = len - 16;
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (data + last)), newlines));
+        mask >>= i - last; // Bytes before i were already searched
+        return mask != 0 ? data + i + __builtin_ctz(mask) : NULL;
+    }
+
+    return findNewlineScalar(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *findNewlineAvx2(const uint8_t *data, size_t len)
+{
+    const __m256i newlines = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    // Two vectors per step; one combined test keeps the loop branch cheap for long packets
+    for(; i + 64 <= len; i += 64){
+        __m256i eqLo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (data + i)), newlines);
+        __m256i eqHi = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (data + i + 32)), newlines);
+        if(!_mm256_testz_si256(_mm256_or_si256(eqLo, eqHi), _mm256_or_si256(eqLo, eqHi))){
+            uint64_t mask = (uint32_t) _mm256_movemask_epi8(eqLo) |
+                            ((uint64_t) (uint32_t) _mm256_movemask_epi8(eqHi) << 32);
+            return data + i + __builtin_ctzll(mask);
+        }
+    }
+
+    for(; i + 32 <= len; i += 32){
+        unsigned mask = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (data + i)), newlines));
+        if(mask != 0){
+            return data + i + __builtin_ctz(mask);
+        }
+    }
+
+    if(i < len && len >= 32){
+        // Finish with one overlapping load rather than dropping to SSE code, which would pay an AVX-SSE
+        // transition on every call
+        size_t last = len - 32;
+        unsigned mask = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (data + last)), newlines));
+        mask >>= i - last; // Bytes before i were already searched
+        return mask != 0 ? data + i + __builtin_ctz(mask) : NULL;
+    }
+
+    return findNewlineScalar(data + i, len - i);
+}
+
+const framing_find_fn framing_find_sse2 = findNewlineSse2;
+const framing_find_fn framing_find_avx2 = findNewlineAvx2;
+#else
+const framing_find_fn framing_find_sse2 = NULL;
+const framing_find_fn framing_find_avx2 = NULL;
+#endif
+
+const framing_find_fn framing_find_scalar = findNewlineScalar;
+
+/**
+ * @return The best implementation for this CPU
+ */
+static framing_find_fn resolveFindNewline(void)
+{
+#ifdef FRAMING_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        return findNewlineAvx2;
+    }
+    if(__builtin_cpu_supports("sse2")){
+        return findNewlineSse2;
+    }
+#endif
+    return findNewlineScalar;
+}
+
+const uint8_t *framing_find_newline(const uint8_t *data, size_t len)
+{
+    // Every thread resolves the same answer, so a racing first call is harmless
+    static _Atomic framing_find_fn impl;
+    framing_find_fn fn = atomic_load_explicit(&impl, memory_order_relaxed);
+    if(fn == NULL){
+        fn = resolveFindNewline();
+        atomic_store_explicit(&impl, fn, memory_order_relaxed);
+    }
+    return fn(data, len);
+}
+
+size_t framing_next_packet(const uint8_t *buffer, size_t len, size_t *scanned)
+{
+    if(*scanned >= len){
+        return 0;
+    }
+
+    const uint8_t *newline = framing_find_newline(buffer + *scanned, len - *scanned);
+    if(newline == NULL){
+        *scanned = len;
+        return 0;
+    }
+    return newline - buffer + 1;
+}
@@ -0,0 +1,43 @@
+/*
+ * framing.h
+ *
+ * Packet framing for aesdsocket: finds the newlines that end packets in
+ * received bytes.
+ *
+ * framing_find_newline() is a memchr for '\n' that uses AVX2 or SSE2 when the
+ * CPU has them (picked once at first use) and a word-at-a-time scalar scan
+ * otherwise, so framing costs about as much per byte as memchr on any target.
+ * framing_next_packet() splits a receive buffer into packets, remembering how
+ * far it has searched so bytes are only scanned once however the packet
+ * arrives.
+ */
+
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @return Pointer to the first '\n' in [data, data + len), or NULL if there is none.
+ */
+const uint8_t *framing_find_newline(const uint8_t *data, size_t len);
+
+/**
+ * @brief Looks for the first complete packet in buffer[0, len). The first *scanned bytes are known to hold
+ *          no newline and are skipped.
+ * @arg scanned in/out search position; reset it to 0 after removing a packet from the front of the buffer
+ * @return Length of the packet including its newline, or 0 if the buffer holds no complete packet yet.
+ */
+size_t framing_next_packet(const uint8_t *buffer, size_t len, size_t *scanned);
+
+/**
+ * Individual implementations behind framing_find_newline(), for framing_bench.
+ * The SIMD ones are NULL where the build target can't have them.
+ */
+typedef const uint8_t *(*framing_find_fn)(const uint8_t *data, size_t len);
+extern const framing_find_fn framing_find_scalar;
+extern const framing_find_fn framing_find_sse2;
+extern const framing_find_fn framing_find_avx2;
+
+#endif /* FRAMING_H */
@@ -0,0 +1,131 @@
+/**
+ * @file framing_bench.c
+ * @brief Microbenchmark for packet framing: the old trailing-newline check against the newline search
+ *          implementations in framing.c and libc memchr.
+ *
+ * Build with "make bench", run ./framing_bench [total_mb].
+ *
+ * Each case frames a stream of packets of one size as it would arrive from recv() in fixed size chunks.
+ * "trailing" only looks at the last byte of each chunk, like the original recv loop; the rest find every
+ * newline and so every packet boundary.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "framing.h"
+
+#define BENCH_CHUNK_BYTES (4096)
+#define BENCH_ROUNDS (5)
+
+static const uint8_t *findMemchr(const uint8_t *data, size_t len)
+{
+    return memchr(data, '\n', len);
+}
+
+static uint64_t monotonicNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * @brief Frames the stream chunk by chunk with find, counting packets
+ */
+static size_t frameWith(framing_find_fn find, const uint8_t *stream, size_t len)
+{
+    size_t packets = 0;
+    for(size_t chunk = 0; chunk < len; chunk += BENCH_CHUNK_BYTES){
+        size_t chunkLen = len - chunk < BENCH_CHUNK_BYTES ? len - chunk : BENCH_CHUNK_BYTES;
+        const uint8_t *p = stream + chunk;
+        const uint8_t *end = p + chunkLen;
+        const uint8_t *newline;
+        while(p < end && (newline = find(p, end - p)) != NULL){
+            packets++;
+            p = newline + 1;
+        }
+    }
+    return packets;
+}
+
+/**
+ * @brief The original check: a chunk completes a packet only if its last byte is a newline
+ */
+static size_t frameTrailing(const uint8_t *stream, size_t len)
+{
+    size_t packets = 0;
+    for(size_t chunk = 0; chunk < len; chunk += BENCH_CHUNK_BYTES){
+        size_t chunkLen = len - chunk < BENCH_CHUNK_BYTES ? len - chunk : BENCH_CHUNK_BYTES;
+        if(stream[chunk + chunkLen - 1] == '\n'){
+            packets++;
+        }
+    }
+    return packets;
+}
+
+static void report(const char *name, size_t packetBytes, size_t len, uint64_t bestNs, size_t packets)
+{
+    printf("%-9s packet=%-7zu %8.2f GB/s %7.3f ns/byte  packets=%zu\n", name, packetBytes,
+           (double) len / bestNs, (double) bestNs / len, packets);
+}
+
+int main(int argc, char **argv)
+{
+    size_t totalBytes = (argc > 1 ? strtoul(argv[1], NULL, 10) : 64) * 1024 * 1024;
+    uint8_t *stream = malloc(totalBytes);
+    if(stream == NULL){
+        perror("malloc");
+        return 1;
+    }
+
+    const size_t packetSizes[] = {16, 100, 1500, 65536, 1024 * 1024};
+    const struct {
+        const char *name;
+        framing_find_fn fn;
+    } impls[] = {
+        {"scalar", framing_find_scalar},
+        {"sse2", framing_find_sse2},
+        {"avx2", framing_find_avx2},
+        {"memchr", findMemchr},
+        {"dispatch", framing_find_newline},
+    };
+
+    for(size_t s = 0; s < sizeof(packetSizes) / sizeof(packetSizes[0]); s++){
+        size_t packetBytes = packetSizes[s];
+        for(size_t i = 0; i < totalBytes; i++){
+            stream[i] = (i % packetBytes == packetBytes - 1) ? '\n' : 'a' + (i % 26);
+        }
+
+        uint64_t best = UINT64_MAX;
+        size_t packets = 0;
+        for(int r = 0; r < BENCH_ROUNDS; r++){
+            uint64_t start = monotonicNs();
+            packets = frameTrailing(stream, totalBytes);
+            uint64_t elapsed = monotonicNs() - start;
+            best = elapsed < best ? elapsed : best;
+        }
+        report("trailing", packetBytes, totalBytes, best ? best : 1, packets);
+
+        for(size_t m = 0; m < sizeof(impls) / sizeof(impls[0]); m++){
+            if(impls[m].fn == NULL){
+                continue; // Not available on this target
+            }
+            best = UINT64_MAX;
+            for(int r = 0; r < BENCH_ROUNDS; r++){
+                uint64_t start = monotonicNs();
+                packets = frameWith(impls[m].fn, stream, totalBytes);
+                uint64_t elapsed = monotonicNs() - start;
+                best = elapsed < best ? elapsed : best;
+            }
+            report(impls[m].name, packetBytes, totalBytes, best, packets);
+        }
+        printf("\n");
+    }
+
+    free(stream);
+    return 0;
+}
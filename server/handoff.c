@@ -0,0 +1,378 @@
+/**
+ * @file handoff.c
+ * @brief Listening socket and data log handoff between an old and a new aesdsocket. See handoff.h.
+ *
+ */
+
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+#define HANDOFF_MAGIC (0x61657364) // "aesd"
+#define HANDOFF_VERSION (2)
+
+/**
+ * Leads the stream; the fds ride along with its first byte. The log's segments follow it.
+ */
+typedef struct handoff_wire_s {
+    uint32_t magic;
+    uint32_t version;
+    int32_t numListenFds;
+    logstore_handoff_t log; // log.segments is meaningless on the wire
+} handoff_wire_t;
+
+static int serverFd = -1;
+static char *serverPath = NULL;
+static struct stat serverStat;  // Identifies our socket file, so we never unlink a successor's
+static pthread_t serverThread;
+static _Atomic bool serverStopping;
+static void (*requestCallback)(void);
+static int requesterFd = -1;    // Connection from the process taking over
+static pthread_mutex_t requestLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requestDone = PTHREAD_COND_INITIALIZER;
+static bool requestPending;     // A request is being answered; the next is accepted once it is over
+static bool handedOver;         // handoff_send succeeded; no more requests
+
+static int fillAddr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path)){
+        fprintf(stderr, "Handoff socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * @return 0 once all len bytes are read, -1 on failure or early EOF
+ */
+static int recvAll(int fd, void *buf, size_t len)
+{
+    size_t got = 0;
+    while(got < len){
+        ssize_t n = recv(fd, (char *) buf + got, len - got, 0);
+        if(n <= 0){
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+/**
+ * @return 0 once all len bytes are sent, -1 on failure
+ */
+static int sendAll(int fd, const void *buf, size_t len)
+{
+    size_t sent = 0;
+    while(sent < len){
+        ssize_t n = send(fd, (const char *) buf + sent, len - sent, MSG_NOSIGNAL);
+        if(n <= 0){
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+int handoff_receive(const char *path, handoff_t *handoff)
+{
+    memset(handoff, 0, sizeof(*handoff));
+    handoff->logFd = -1;
+
+    struct sockaddr_un addr;
+    if(fillAddr(&addr, path) == -1){
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1){
+        perror("handoff socket");
+        return -1;
+    }
+    if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1){
+        int err = errno;
+        close(fd);
+        if(err == ENOENT || err == ECONNREFUSED){
+            return 0; // Nobody to take over from
+        }
+        errno = err;
+        perror("handoff connect");
+        return -1;
+    }
+
+    // Blocks while the old process drains its connections
+    handoff_wire_t wire;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * (HANDOFF_MAX_LISTENERS + 1))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = &wire, .iov_len = sizeof(wire)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while(n < 0 && errno == EINTR);
+    if(n <= 0){
+        fprintf(stderr, "handoff: old process hung up\n");
+        goto fail;
+    }
+
+    // Collect the fds first so every failure path below closes them
+    int fds[HANDOFF_MAX_LISTENERS + 1];
+    int numFds = 0;
+    for(struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)){
+        if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS){
+            numFds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(c), numFds * sizeof(int));
+        }
+    }
+
+    if(recvAll(fd, (char *) &wire + n, sizeof(wire) - n) == -1 || (msg.msg_flags & MSG_CTRUNC) ||
+       wire.magic != HANDOFF_MAGIC || wire.version != HANDOFF_VERSION ||
+       wire.numListenFds < 1 || wire.numListenFds + 1 != numFds){
+        fprintf(stderr, "handoff: malformed or incompatible handoff\n");
+        for(int i = 0; i < numFds; i++){
+            close(fds[i]);
+        }
+        goto fail;
+    }
+    handoff->numListenFds = wire.numListenFds;
+    memcpy(handoff->listenFds, fds, wire.numListenFds * sizeof(int));
+    handoff->logFd = fds[wire.numListenFds];
+    handoff->log = wire.log;
+
+    handoff->log.segments = calloc(wire.log.segmentCount ? wire.log.segmentCount : 1, sizeof(logstore_segment_t));
+    if(handoff->log.segments == NULL ||
+       recvAll(fd, handoff->log.segments, wire.log.segmentCount * sizeof(logstore_segment_t)) == -1){
+        fprintf(stderr, "handoff: log index lost\n");
+        goto failFds;
+    }
+
+    // Tell the old process we have everything, then wait for it to commit to exiting. Without the go byte
+    // an old process that gave up on us (and kept serving) and this one would both write the log.
+    char ack = 1;
+    if(sendAll(fd, &ack, 1) == -1){
+        perror("handoff ack");
+        goto failFds;
+    }
+    char go;
+    if(recvAll(fd, &go, 1) == -1){
+        fprintf(stderr, "handoff: old process kept serving\n");
+        goto failFds;
+    }
+    close(fd);
+    return 1;
+
+failFds:
+    for(int i = 0; i < handoff->numListenFds; i++){
+        close(handoff->listenFds[i]);
+    }
+    close(handoff->logFd);
+    free(handoff->log.segments);
+    handoff->log.segments = NULL;
+fail:
+    close(fd);
+    return -1;
+}
+
+/**
+ * @brief Upgrade server thread: answers requests one at a time until a process has taken over from this one
+ */
+static void *handoffServerThread(void *arg)
+{
+    (void) arg;
+    while(!atomic_load(&serverStopping)){
+        int fd = accept4(serverFd, NULL, NULL, SOCK_CLOEXEC);
+        if(fd == -1){
+            if(errno != EINTR && !atomic_load(&serverStopping)){
+                perror("handoff accept");
+            }
+            continue;
+        }
+        pthread_mutex_lock(&requestLock);
+        requesterFd = fd;
+        requestPending = true;
+        pthread_mutex_unlock(&requestLock);
+
+        requestCallback();
+
+        // Until handoff_send() succeeds, or fails and the caller is serving again (handoff_server_rearm())
+        pthread_mutex_lock(&requestLock);
+        while(requestPending && !atomic_load(&serverStopping)){
+            pthread_cond_wait(&requestDone, &requestLock);
+        }
+        bool done = handedOver;
+        pthread_mutex_unlock(&requestLock);
+        if(done){
+            break;
+        }
+    }
+    return NULL;
+}
+
+int handoff_server_start(const char *path, void (*onRequest)(void))
+{
+    struct sockaddr_un addr;
+    if(fillAddr(&addr, path) == -1){
+        return -1;
+    }
+
+    serverFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(serverFd == -1){
+        perror("handoff server socket");
+        return -1;
+    }
+
+    // Either left behind by an earlier run or belongs to the process we just took over from
+    unlink(path);
+    if(bind(serverFd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(serverFd, 1) == -1 ||
+       stat(path, &serverStat) == -1){
+        perror("handoff server bind");
+        close(serverFd);
+        serverFd = -1;
+        return -1;
+    }
+
+    serverPath = strdup(path);
+    requestCallback = onRequest;
+    requestPending = false;
+    handedOver = false;
+    atomic_store(&serverStopping, false);
+
+    // Leave signals to the serving threads
+    sigset_t blocked, previous;
+    sigfillset(&blocked);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    int rc = pthread_create(&serverThread, NULL, handoffServerThread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if(rc != 0){
+        perror("pthread_create handoff server");
+        free(serverPath);
+        serverPath = NULL;
+        handoff_server_stop();
+        return -1;
+    }
+    return 0;
+}
+
+int handoff_send(const handoff_t *handoff)
+{
+    if(requesterFd == -1){
+        return -1;
+    }
+
+    // A new process that stops responding must not keep this one from serving again
+    struct timeval timeout = {.tv_sec = HANDOFF_ACK_SEC};
+    setsockopt(requesterFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(requesterFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    handoff_wire_t wire = {.magic = HANDOFF_MAGIC, .version = HANDOFF_VERSION,
+                           .numListenFds = handoff->numListenFds, .log = handoff->log};
+    wire.log.segments = NULL;
+
+    int numFds = handoff->numListenFds + 1;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * (HANDOFF_MAX_LISTENERS + 1))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = &wire, .iov_len = sizeof(wire)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                         .msg_controllen = CMSG_SPACE(sizeof(int) * numFds)};
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
+    memcpy(CMSG_DATA(c), handoff->listenFds, handoff->numListenFds * sizeof(int));
+    memcpy(CMSG_DATA(c) + handoff->numListenFds * sizeof(int), &handoff->logFd, sizeof(int));
+
+    int rc = -1;
+    ssize_t n;
+    do {
+        n = sendmsg(requesterFd, &msg, MSG_NOSIGNAL);
+    } while(n < 0 && errno == EINTR);
+    char ack;
+    char go = 1;
+    if(n > 0 && sendAll(requesterFd, (char *) &wire + n, sizeof(wire) - n) == 0 &&
+       sendAll(requesterFd, handoff->log.segments, handoff->log.segmentCount * sizeof(logstore_segment_t)) == 0 &&
+       recvAll(requesterFd, &ack, 1) == 0 && sendAll(requesterFd, &go, 1) == 0){
+        rc = 0;
+    } else {
+        fprintf(stderr, "handoff: new process did not take over\n");
+    }
+
+    pthread_mutex_lock(&requestLock);
+    close(requesterFd);
+    requesterFd = -1;
+    if(rc == 0){
+        handedOver = true;
+        requestPending = false;
+        pthread_cond_signal(&requestDone);
+    }
+    pthread_mutex_unlock(&requestLock);
+    return rc;
+}
+
+void handoff_server_rearm(void)
+{
+    pthread_mutex_lock(&requestLock);
+    requestPending = false;
+    pthread_cond_signal(&requestDone);
+    pthread_mutex_unlock(&requestLock);
+}
+
+void handoff_server_stop(void)
+{
+    if(serverFd == -1){
+        return;
+    }
+
+    // Shutting the listener down makes a blocked accept() return; the signal ends a wait on a request
+    pthread_mutex_lock(&requestLock);
+    atomic_store(&serverStopping, true);
+    pthread_cond_signal(&requestDone);
+    pthread_mutex_unlock(&requestLock);
+    if(serverPath != NULL){
+        shutdown(serverFd, SHUT_RDWR);
+        pthread_join(serverThread, NULL);
+    }
+    close(serverFd);
+    serverFd = -1;
+    if(requesterFd != -1){
+        close(requesterFd);
+        requesterFd = -1;
+    }
+
+    if(serverPath != NULL){
+        struct stat st;
+        if(stat(serverPath, &st) == 0 && st.st_ino == serverStat.st_ino && st.st_dev == serverStat.st_dev){
+            unlink(serverPath);
+        }
+        free(serverPath);
+        serverPath = NULL;
+    }
+}
@@ -0,0 +1,77 @@
+/*
+ * handoff.h
+ *
+ * Zero-downtime restart (-H <path>). A running aesdsocket serves upgrade
+ * requests on a Unix socket at path. A new process started with the same -H
+ * connects to it before opening anything itself:
+ *
+ *   1. The old process stops accepting and drains its in-flight connections
+ *      (at most HANDOFF_DRAIN_MS). New clients wait in the listen backlog of
+ *      the still-open listening sockets, deepened to SOMAXCONN for the swap,
+ *      so none are refused. The drain comes first because the log has a
+ *      single writer: connections in flight are still appending to it.
+ *   2. It sends its listening sockets and the open data log over the Unix
+ *      socket (SCM_RIGHTS), along with the log's state (logstore_export()).
+ *   3. The new process acknowledges, and the old one answers with a final
+ *      byte to say it is committed. It exits without removing the log, and the
+ *      new process adopts the log as it is, mapped and indexed, and starts
+ *      accepting on the same sockets.
+ *
+ * If the handoff fails before that last byte (the new process died, sent
+ * nothing for HANDOFF_ACK_SEC, or spoke another version), the new process
+ * gives everything back and the old one resumes serving on the same sockets
+ * and log, and answers the next request.
+ *
+ * Keep-alive connections are closed between packets while draining, so their
+ * clients reconnect (to the new process) for the next one. If nothing answers
+ * at path the new process starts cold, as without -H.
+ */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "logstore.h"
+
+#define HANDOFF_MAX_LISTENERS (252) // SCM_RIGHTS carries at most 253 fds, one of them the log
+#define HANDOFF_DRAIN_MS (1000)     // Connections still open this long into a handoff are dropped
+#define HANDOFF_ACK_SEC (5)         // How long the old process waits on a new one that stops responding
+
+typedef struct handoff_s {
+    int listenFds[HANDOFF_MAX_LISTENERS];
+    int numListenFds;
+    int logFd;
+    logstore_handoff_t log;
+} handoff_t;
+
+/**
+ * @brief Asks the process serving upgrades at path to hand over, and waits until it has
+ * @return 1 with handoff filled in (free handoff->log.segments when done), 0 if no process answers at
+ *          path, -1 on failure.
+ */
+int handoff_receive(const char *path, handoff_t *handoff);
+
+/**
+ * @brief Serves upgrade requests at path from a background thread. onRequest is called, from that thread,
+ *          when a new process asks to take over; the caller then stops serving and calls handoff_send().
+ *          No further request is taken until handoff_send() fails and the caller calls handoff_server_rearm().
+ * @return 0 on success, -1 on failure.
+ */
+int handoff_server_start(const char *path, void (*onRequest)(void));
+
+/**
+ * @brief Sends handoff to the process that asked for it
+ * @return 0 once the new process has it, -1 on failure (the caller still owns everything).
+ */
+int handoff_send(const handoff_t *handoff);
+
+/**
+ * @brief Takes upgrade requests again after a failed handoff_send(), once the caller is serving again
+ */
+void handoff_server_rearm(void);
+
+/**
+ * @brief Stops serving upgrade requests. Removes the socket at path unless a newer process has replaced it.
+ */
+void handoff_server_stop(void);
+
+#endif /* HANDOFF_H */
@@ -0,0 +1,782 @@
+/**
+ * @file logstore.c
+ * @brief Memory-mapped, append-only data log used by aesdsocket
+ *
+ */
+
+#define _GNU_SOURCE // fallocate
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "logstore.h"
+#include "bufpool.h"
+#include "metrics.h"
+
+// Address space set aside for the mapping. Large on 64-bit; 32-bit targets cannot spare much.
+#if UINTPTR_MAX > 0xffffffffu
+#define LOGSTORE_RESERVE_BYTES ((size_t) 64 * 1024 * 1024 * 1024)
+#else
+#define LOGSTORE_RESERVE_BYTES ((size_t) 512 * 1024 * 1024)
+#endif
+
+// Retention drops at least this fine a fraction of the window at a time
+#define LOGSTORE_MIN_RETAIN_SEGMENTS (8)
+
+/**
+ * @brief Makes sure at least needed bytes of the file are allocated and mapped
+ * @return 0 on success, -1 on failure.
+ */
+static int logstoreGrow(logstore_t *store, size_t needed)
+{
+    if(needed <= atomic_load(&store->mappedBytes)){
+        return 0;
+    }
+
+    int rc = 0;
+    pthread_mutex_lock(&store->growLock);
+
+    size_t mapped = atomic_load(&store->mappedBytes);
+    if(needed > mapped){
+        size_t newMapped = ((needed + store->extentBytes - 1) / store->extentBytes) * store->extentBytes;
+        if(newMapped > store->reserveBytes){
+            errno = EFBIG;
+            perror("log exceeds reserved mapping");
+            rc = -1;
+            goto out;
+        }
+
+        // Allocate blocks now so stores into the mapping can't fail on a full disk. KEEP_SIZE leaves the file
+        // length alone: it only ever covers committed packets (see logstoreFlushBatch), so a crash can't leave
+        // a preallocated tail that a restart would take for log data.
+        if(fallocate(store->fd, FALLOC_FL_KEEP_SIZE, mapped, newMapped - mapped) == -1 &&
+           errno != EOPNOTSUPP && errno != ENOSYS){
+            perror("fallocate log extent");
+            rc = -1;
+            goto out;
+        }
+
+        void *p = mmap(store->base + mapped, newMapped - mapped, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_FIXED, store->fd, mapped);
+        if(p == MAP_FAILED){
+            perror("mmap log extent");
+            rc = -1;
+            goto out;
+        }
+
+        atomic_store(&store->mappedBytes, newMapped);
+    }
+
+out:
+    pthread_mutex_unlock(&store->growLock);
+    return rc;
+}
+
+/**
+ * @brief Sizes the ring for a retention policy: segments of at most one extent, at least
+ *          LOGSTORE_MIN_RETAIN_SEGMENTS per window, and one spare segment for readers that fall behind
+ */
+static int logstoreRetentionInit(logstore_t *store, const logstore_retention_t *retention, size_t page)
+{
+    store->retention = *retention;
+    if(store->retention.maxBytes == 0){
+        store->retention.maxBytes = LOGSTORE_DEFAULT_RETAIN_BYTES;
+    }
+
+    // Segments are only bookkeeping, so they need no alignment; the ring is mapped and so is page aligned
+    size_t segment = store->retention.maxBytes / LOGSTORE_MIN_RETAIN_SEGMENTS;
+    if(segment == 0){
+        segment = 1;
+    }
+    if(segment > store->extentBytes){
+        segment = store->extentBytes;
+    }
+    store->segmentBytes = segment;
+    store->ringBytes = ((store->retention.maxBytes + segment + page - 1) / page) * page;
+    store->reserveBytes = 2 * store->ringBytes;
+
+    // With a record limit segments also close after a fraction of it, so records are dropped in small steps too
+    if(store->retention.maxRecords > 0){
+        store->segmentRecords = store->retention.maxRecords / LOGSTORE_MIN_RETAIN_SEGMENTS;
+        if(store->segmentRecords == 0){
+            store->segmentRecords = 1;
+        }
+    }
+
+    // Likewise with an age limit, so fresh packets don't share a segment with ones about to expire
+    if(store->retention.maxAgeSec > 0){
+        store->segmentSec = store->retention.maxAgeSec / LOGSTORE_MIN_RETAIN_SEGMENTS;
+        if(store->segmentSec == 0){
+            store->segmentSec = 1;
+        }
+    }
+
+    // Enough for a full window of byte-closed segments plus the record- and age-closed ones
+    store->numSegments = store->retention.maxBytes / segment + 2 * LOGSTORE_MIN_RETAIN_SEGMENTS + 5;
+    store->segments = calloc(store->numSegments, sizeof(*store->segments));
+    if(store->segments == NULL){
+        perror("alloc retention index");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Allocates the whole ring file and maps it twice, back to back, so a window that wraps around the end
+ *          of the file is still contiguous in memory
+ * @return 0 on success, -1 on failure.
+ */
+static int logstoreRingMap(logstore_t *store, bool reset)
+{
+    if(reset && ftruncate(store->fd, 0) == -1){
+        perror("reset log ring");
+        return -1;
+    }
+    if(fallocate(store->fd, 0, 0, store->ringBytes) == -1 &&
+       ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(store->fd, store->ringBytes) == -1)){
+        perror("allocate log ring");
+        return -1;
+    }
+
+    for(int copy = 0; copy < 2; copy++){
+        void *p = mmap(store->base + copy * store->ringBytes, store->ringBytes, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_FIXED, store->fd, 0);
+        if(p == MAP_FAILED){
+            perror("mmap log ring");
+            return -1;
+        }
+    }
+    atomic_store(&store->mappedBytes, store->ringBytes);
+    return 0;
+}
+
+/**
+ * @brief Sets up everything but the file: locks, extent size and, with a retention policy, the ring geometry
+ * @return 0 on success, -1 on failure.
+ */
+static int logstoreInit(logstore_t *store, size_t extentBytes, const logstore_retention_t *retention)
+{
+    memset(store, 0, sizeof(*store));
+    store->fd = -1;
+    store->base = MAP_FAILED;
+
+    // Extents are mapped at file offsets that are multiples of extentBytes, so keep it page aligned
+    size_t page = sysconf(_SC_PAGESIZE);
+    store->extentBytes = ((extentBytes + page - 1) / page) * page;
+    store->reserveBytes = LOGSTORE_RESERVE_BYTES;
+    pthread_mutex_init(&store->growLock, NULL);
+    pthread_mutex_init(&store->commitLock, NULL);
+    pthread_cond_init(&store->commitDone, NULL);
+    STAILQ_INIT(&store->pending);
+
+    if(retention != NULL && (retention->maxBytes || retention->maxRecords || retention->maxAgeSec) &&
+       logstoreRetentionInit(store, retention, page) == -1){
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Takes ownership of the open log fd, remembers its directory and reserves the address range
+ * @return 0 on success, -1 on failure.
+ */
+static int logstoreAttach(logstore_t *store, const char *path, int fd)
+{
+    store->fd = fd;
+
+    char *pathCopy = strdup(path);
+    store->dir = pathCopy ? strdup(dirname(pathCopy)) : NULL;
+    free(pathCopy);
+    if(store->dir == NULL){
+        perror("Could not copy log directory");
+        return -1;
+    }
+
+    store->base = mmap(NULL, store->reserveBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(store->base == MAP_FAILED){
+        perror("reserve log mapping");
+        return -1;
+    }
+    return 0;
+}
+
+int logstore_open(logstore_t *store, const char *path, size_t extentBytes, const logstore_retention_t *retention)
+{
+    if(logstoreInit(store, extentBytes, retention) == -1){
+        goto fail;
+    }
+
+    int fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, 0777);
+    if(fd == -1){
+        perror("Could not open log");
+        goto fail;
+    }
+    if(logstoreAttach(store, path, fd) == -1){
+        goto fail;
+    }
+
+    if(store->ringBytes != 0){
+        // A ring's layout can't be recovered from the file alone, so a retained log starts empty
+        if(logstoreRingMap(store, true) == -1){
+            goto fail;
+        }
+        metrics_set(METRIC_GAUGE_LOG_BYTES, 0);
+        return 0;
+    }
+
+    struct stat st;
+    if(fstat(store->fd, &st) == -1){
+        perror("Stat failed");
+        goto fail;
+    }
+
+    // The file is never longer than the log, even after a crash, so its length is what was committed
+    if(logstoreGrow(store, st.st_size) == -1){
+        goto fail;
+    }
+    atomic_store(&store->committed, st.st_size);
+    metrics_set(METRIC_GAUGE_LOG_BYTES, st.st_size);
+
+    return 0;
+
+fail:
+    logstore_close(store);
+    return -1;
+}
+
+int logstore_adopt(logstore_t *store, int fd, const char *path, size_t extentBytes, const logstore_handoff_t *state)
+{
+    if(logstoreInit(store, extentBytes, &state->retention) == -1){
+        close(fd);
+        goto fail;
+    }
+    if(logstoreAttach(store, path, fd) == -1){
+        goto fail;
+    }
+
+    if(store->ringBytes != 0){
+        // Same policy, same geometry: the ring file and its index carry over as they are
+        if(state->segmentCount > store->numSegments){
+            fprintf(stderr, "Handed off log has %zu segments, ring holds %zu\n", state->segmentCount,
+                    store->numSegments);
+            goto fail;
+        }
+        if(logstoreRingMap(store, false) == -1){
+            goto fail;
+        }
+        memcpy(store->segments, state->segments, state->segmentCount * sizeof(*store->segments));
+        store->segmentHead = 0;
+        store->segmentCount = state->segmentCount;
+        store->retainedRecords = state->retainedRecords;
+        atomic_store(&store->start, state->start);
+        atomic_store(&store->reclaimed, state->reclaimed);
+    } else if(logstoreGrow(store, state->committed) == -1){
+        goto fail;
+    }
+
+    atomic_store(&store->committed, state->committed);
+    metrics_set(METRIC_GAUGE_LOG_BYTES, state->committed - state->start);
+    return 0;
+
+fail:
+    logstore_detach(store); // Never trim: the file still belongs to the process that handed it off
+    return -1;
+}
+
+int logstore_export(logstore_t *store, logstore_handoff_t *state)
+{
+    memset(state, 0, sizeof(*state));
+    if(store->ringBytes != 0){
+        state->retention = store->retention;
+        state->segments = calloc(store->segmentCount ? store->segmentCount : 1, sizeof(*state->segments));
+        if(state->segments == NULL){
+            perror("alloc handoff segments");
+            return -1;
+        }
+        // Unroll the FIFO, oldest first
+        for(size_t i = 0; i < store->segmentCount; i++){
+            state->segments[i] = store->segments[(store->segmentHead + i) % store->numSegments];
+        }
+        state->segmentCount = store->segmentCount;
+        state->retainedRecords = store->retainedRecords;
+    }
+    state->committed = atomic_load(&store->committed);
+    state->start = atomic_load(&store->start);
+    state->reclaimed = atomic_load(&store->reclaimed);
+    return 0;
+}
+
+/**
+ * @brief Copies one queued packet, staged part first, to dst
+ * @return 0 on success, -1 if the stage couldn't be read back in full.
+ */
+static int logstoreCopyPacket(char *dst, const logstore_commit_t *req)
+{
+    size_t staged = 0;
+    if(req->stage != NULL){
+        // Read the staged part straight into the mapping; page cache to page cache, no bounce buffer
+        while(staged < req->stage->len){
+            ssize_t n = pread(req->stage->fd, dst + staged, req->stage->len - staged, staged);
+            if(n <= 0){
+                if(n < 0 && errno == EINTR){
+                    continue;
+                }
+                perror("read staged packet");
+                break;
+            }
+            staged += n;
+        }
+        if(staged < req->stage->len){
+            return -1;
+        }
+    }
+    memcpy(dst + staged, req->data, req->len - staged);
+    return 0;
+}
+
+/**
+ * @brief msyncs log bytes [start, end) when syncOnCommit is set
+ */
+static void logstoreSync(logstore_t *store, size_t start, size_t end)
+{
+    if(!store->syncOnCommit || end == start){
+        return;
+    }
+
+    // msync wants a page aligned start
+    const char *from = logstore_at(store, start);
+    size_t misalign = (uintptr_t) from % sysconf(_SC_PAGESIZE);
+    if(msync((void *) (from - misalign), end - start + misalign, MS_SYNC) == -1){
+        perror("msync log batch");
+    }
+}
+
+/**
+ * @brief Writes a batch of queued appends contiguously and publishes them in one step.
+ *          Called by the flush leader without commitLock held.
+ */
+static void logstoreFlushBatch(logstore_t *store, struct logstore_commit_queue *batch)
+{
+    logstore_commit_t *req;
+    size_t start = atomic_load(&store->committed);
+    size_t total = 0;
+    STAILQ_FOREACH(req, batch, entries){
+        total += req->len;
+    }
+
+    // Extend the file over the batch before writing it: the mapping past the end of the file can't be stored to
+    bool extended = logstoreGrow(store, start + total) == 0;
+    if(extended && ftruncate(store->fd, start + total) == -1){
+        perror("extend log");
+        extended = false;
+    }
+    if(!extended){
+        STAILQ_FOREACH(req, batch, entries){
+            req->end = -1;
+        }
+        return;
+    }
+
+    size_t off = start;
+    STAILQ_FOREACH(req, batch, entries){
+        if(logstoreCopyPacket(store->base + off, req) == -1){
+            // Short stage: leave it out rather than publish a torn packet
+            req->end = -1;
+            continue;
+        }
+        off += req->len;
+        req->end = off;
+    }
+
+    // A packet left out shortened the batch; don't leave its space on the end of the file
+    if(off != start + total && ftruncate(store->fd, off) == -1){
+        perror("trim log batch");
+    }
+
+    logstoreSync(store, start, off);
+    atomic_store_explicit(&store->committed, off, memory_order_release);
+    metrics_set(METRIC_GAUGE_LOG_BYTES, off);
+}
+
+/**
+ * @brief Drops the oldest retained segment by moving the window start to the next segment (or to end, emptying
+ *          the window). Flush leader only.
+ * @arg mayEmpty false keeps the newest segment, so the window still holds the latest packet
+ * @return Bytes dropped; 0 if there was nothing to drop.
+ */
+static size_t logstoreDropOldest(logstore_t *store, size_t end, bool mayEmpty)
+{
+    if(store->segmentCount == 0 || (!mayEmpty && store->segmentCount == 1)){
+        return 0;
+    }
+
+    logstore_segment_t *oldest = &store->segments[store->segmentHead];
+    store->retainedRecords -= oldest->records;
+    store->segmentHead = (store->segmentHead + 1) % store->numSegments;
+    store->segmentCount--;
+
+    size_t start = atomic_load(&store->start);
+    size_t newStart = store->segmentCount ? store->segments[store->segmentHead].firstPacket : end;
+    atomic_store(&store->start, newStart);
+    return newStart - start;
+}
+
+/**
+ * @brief Counts a packet written at off in the newest segment, first closing that segment if it is full
+ * @return Bytes dropped to make room in the index (only when a huge batch outpaces the retention checks).
+ */
+static size_t logstoreIndexPacket(logstore_t *store, size_t off, time_t now)
+{
+    size_t dropped = 0;
+    logstore_segment_t *newest = NULL;
+    if(store->segmentCount > 0){
+        newest = &store->segments[(store->segmentHead + store->segmentCount - 1) % store->numSegments];
+    }
+
+    if(newest == NULL || off - newest->firstPacket >= store->segmentBytes ||
+       (store->segmentRecords > 0 && newest->records >= store->segmentRecords) ||
+       (store->segmentSec > 0 && now - newest->oldest >= store->segmentSec)){
+        if(store->segmentCount == store->numSegments){
+            dropped = logstoreDropOldest(store, off, true);
+        }
+        newest = &store->segments[(store->segmentHead + store->segmentCount) % store->numSegments];
+        store->segmentCount++;
+        newest->firstPacket = off;
+        newest->records = 0;
+        newest->oldest = now;
+    }
+
+    newest->records++;
+    newest->newest = now;
+    store->retainedRecords++;
+    return dropped;
+}
+
+/**
+ * @brief Ring flavour of logstoreFlushBatch: drops old segments to make room, then writes the batch into the
+ *          ring in runs of at most the window size, publishing each run, then applies the record and age limits
+ * @return Bytes dropped from the window.
+ */
+static size_t logstoreFlushRing(logstore_t *store, struct logstore_commit_queue *batch)
+{
+    size_t maxBytes = store->retention.maxBytes;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    size_t dropped = 0;
+
+    logstore_commit_t *req = STAILQ_FIRST(batch);
+    while(req != NULL)
+    {
+        // Packets larger than the window are rejected (end stays -1)
+        size_t total = 0;
+        logstore_commit_t *runEnd = req;
+        for(; runEnd != NULL; runEnd = STAILQ_NEXT(runEnd, entries)){
+            if(runEnd->len > maxBytes){
+                continue;
+            }
+            if(total + runEnd->len > maxBytes){
+                break;
+            }
+            total += runEnd->len;
+        }
+
+        size_t start = atomic_load(&store->committed);
+        while(start + total - atomic_load(&store->start) > maxBytes){
+            dropped += logstoreDropOldest(store, start, true);
+        }
+
+        // Announce the overwrite before making it: the fence keeps the copies below from becoming visible
+        // ahead of reclaimed, so a reader whose copy caught any of them sees it (logstore_replay_chunk)
+        if(start + total > store->ringBytes){
+            atomic_store_explicit(&store->reclaimed, start + total - store->ringBytes, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+        }
+
+        size_t off = start;
+        for(; req != runEnd; req = STAILQ_NEXT(req, entries)){
+            if(req->len > maxBytes){
+                errno = EFBIG;
+                perror("packet larger than log retention window");
+                continue;
+            }
+            if(logstoreCopyPacket(store->base + off % store->ringBytes, req) == -1){
+                continue;
+            }
+            dropped += logstoreIndexPacket(store, off, ts.tv_sec);
+            off += req->len;
+            req->end = off;
+        }
+
+        logstoreSync(store, start, off);
+        atomic_store_explicit(&store->committed, off, memory_order_release);
+    }
+
+    // Record and age limits never drop the newest segment, so the latest packet always survives
+    size_t end = atomic_load(&store->committed);
+    while(store->segmentCount > 1){
+        logstore_segment_t *oldest = &store->segments[store->segmentHead];
+        bool tooMany = store->retention.maxRecords > 0 && store->retainedRecords > store->retention.maxRecords;
+        bool tooOld = store->retention.maxAgeSec > 0 && ts.tv_sec - oldest->newest >= store->retention.maxAgeSec;
+        if(!tooMany && !tooOld){
+            break;
+        }
+        dropped += logstoreDropOldest(store, end, false);
+    }
+
+    metrics_set(METRIC_GAUGE_LOG_BYTES, end - atomic_load(&store->start));
+    return dropped;
+}
+
+/**
+ * @brief Queues one append and waits until a flush (possibly its own) has written it
+ * @return The log offset just past this append, or -1 on failure.
+ */
+static ssize_t logstoreCommit(logstore_t *store, const logstore_stage_t *stage, const void *data, size_t len)
+{
+    logstore_commit_t req = {.stage = stage, .data = data, .len = len, .end = -1, .done = false,
+                             .queuedNs = metrics_now_ns()};
+
+    pthread_mutex_lock(&store->commitLock);
+    STAILQ_INSERT_TAIL(&store->pending, &req, entries);
+
+    while(!req.done){
+        if(store->flushing){
+            // Someone else is flushing; we go out with the next batch (or this one finished us)
+            pthread_cond_wait(&store->commitDone, &store->commitLock);
+            continue;
+        }
+
+        // Become the leader: take everything queued so far, ourselves included
+        struct logstore_commit_queue batch = STAILQ_HEAD_INITIALIZER(batch);
+        STAILQ_CONCAT(&batch, &store->pending);
+        store->flushing = true;
+        pthread_mutex_unlock(&store->commitLock);
+
+        uint64_t startNs = metrics_now_ns();
+        size_t dropped = 0;
+        if(store->ringBytes != 0){
+            dropped = logstoreFlushRing(store, &batch);
+        } else {
+            logstoreFlushBatch(store, &batch);
+        }
+        uint64_t elapsedNs = metrics_now_ns() - startNs;
+
+        // Submitters are still blocked until done is set, so their requests can be read unlocked
+        logstore_commit_t *done;
+        uint64_t packets = 0;
+        STAILQ_FOREACH(done, &batch, entries){
+            metrics_observe(METRIC_HIST_LOG_WAIT, startNs - done->queuedNs);
+            packets += done->end != -1;
+        }
+        metrics_observe(METRIC_HIST_LOG_HOLD, elapsedNs);
+        metrics_add(METRIC_PACKETS, packets);
+
+        pthread_mutex_lock(&store->commitLock);
+        packets = 0;
+        STAILQ_FOREACH(done, &batch, entries){
+            done->done = true;
+            packets++;
+            store->stats.bytes += done->len;
+        }
+        store->stats.batches++;
+        store->stats.droppedBytes += dropped;
+        store->stats.packets += packets;
+        if(packets > store->stats.maxBatchPackets){
+            store->stats.maxBatchPackets = packets;
+        }
+        store->stats.flushNsTotal += elapsedNs;
+        if(elapsedNs > store->stats.flushNsMax){
+            store->stats.flushNsMax = elapsedNs;
+        }
+
+        store->flushing = false;
+        pthread_cond_broadcast(&store->commitDone);
+    }
+
+    pthread_mutex_unlock(&store->commitLock);
+    return req.end;
+}
+
+ssize_t logstore_append(logstore_t *store, const void *data, size_t len)
+{
+    return logstoreCommit(store, NULL, data, len);
+}
+
+int logstore_stage_open(logstore_t *store, logstore_stage_t *stage)
+{
+    stage->len = 0;
+    stage->fd = open(store->dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if(stage->fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)){
+        // No O_TMPFILE on this filesystem; an unlinked named file behaves the same
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/.aesdstage.XXXXXX", store->dir);
+        stage->fd = mkostemp(path, O_CLOEXEC);
+        if(stage->fd != -1){
+            unlink(path);
+        }
+    }
+    if(stage->fd == -1){
+        perror("open packet stage");
+        return -1;
+    }
+    return 0;
+}
+
+int logstore_stage_write(logstore_stage_t *stage, const void *data, size_t len)
+{
+    const char *p = data;
+    size_t written = 0;
+    while(written < len){
+        ssize_t n = pwrite(stage->fd, p + written, len - written, stage->len + written);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("write packet stage");
+            return -1;
+        }
+        written += n;
+    }
+    stage->len += len;
+    return 0;
+}
+
+ssize_t logstore_append_staged(logstore_t *store, logstore_stage_t *stage, const void *tail, size_t tailLen)
+{
+    ssize_t end = logstoreCommit(store, stage->len ? stage : NULL, tail, stage->len + tailLen);
+
+    // Drop the staged blocks so the stage doesn't hold disk space between packets
+    if(stage->len > 0 && ftruncate(stage->fd, 0) == -1){
+        perror("reset packet stage");
+    }
+    stage->len = 0;
+    return end;
+}
+
+void logstore_stage_close(logstore_stage_t *stage)
+{
+    if(stage->fd != -1){
+        close(stage->fd);
+        stage->fd = -1;
+    }
+    stage->len = 0;
+}
+
+void logstore_get_stats(logstore_t *store, logstore_stats_t *stats)
+{
+    pthread_mutex_lock(&store->commitLock);
+    *stats = store->stats;
+    pthread_mutex_unlock(&store->commitLock);
+}
+
+size_t logstore_size(logstore_t *store)
+{
+    return atomic_load_explicit(&store->committed, memory_order_acquire);
+}
+
+size_t logstore_start(logstore_t *store)
+{
+    return atomic_load(&store->start);
+}
+
+const char *logstore_at(logstore_t *store, size_t off)
+{
+    return store->base + (store->ringBytes ? off % store->ringBytes : off);
+}
+
+bool logstore_intact(logstore_t *store, size_t off)
+{
+    return off >= atomic_load(&store->reclaimed);
+}
+
+const char *logstore_replay_chunk(logstore_t *store, logstore_snapshot_t *snap, size_t off, size_t end, size_t *len)
+{
+    if(store->ringBytes == 0){
+        *len = end - off;
+        return logstore_at(store, off);
+    }
+
+    if(off < snap->start || off >= snap->start + snap->len){
+        if(snap->buf == NULL){
+            snap->buf = bufpool_get(LOGSTORE_SNAPSHOT_BYTES, &snap->capacity);
+            if(snap->buf == NULL){
+                return NULL;
+            }
+        }
+        size_t n = end - off < snap->capacity ? end - off : snap->capacity;
+        memcpy(snap->buf, logstore_at(store, off), n);
+
+        // Pairs with the fence in logstoreFlushRing: a copy that caught an overwrite sees reclaimed past off.
+        // The ring overwrites oldest first, so checking off covers the whole copy.
+        atomic_thread_fence(memory_order_acquire);
+        if(!logstore_intact(store, off)){
+            snap->len = 0;
+            return NULL;
+        }
+        snap->start = off;
+        snap->len = n;
+    }
+
+    size_t snapEnd = snap->start + snap->len;
+    *len = (snapEnd < end ? snapEnd : end) - off;
+    return snap->buf + (off - snap->start);
+}
+
+void logstore_snapshot_release(logstore_snapshot_t *snap)
+{
+    bufpool_put(snap->buf);
+    memset(snap, 0, sizeof(*snap));
+}
+
+/**
+ * @brief Unmaps and frees everything; trim drops the unused preallocated tail of a plain log
+ */
+static void logstoreRelease(logstore_t *store, bool trim)
+{
+    if(store->extentBytes == 0){
+        return; // Never opened, or already closed
+    }
+
+    if(store->base != MAP_FAILED && store->base != NULL){
+        munmap(store->base, store->reserveBytes);
+        store->base = MAP_FAILED;
+    }
+
+    if(store->fd != -1){
+        // Release the blocks preallocated past the end of the log (only if we ever extended the file)
+        if(trim && store->ringBytes == 0 && atomic_load(&store->mappedBytes) != 0 &&
+           ftruncate(store->fd, atomic_load(&store->committed)) == -1){
+            perror("trim log");
+        }
+        close(store->fd);
+        store->fd = -1;
+    }
+
+    free(store->dir);
+    store->dir = NULL;
+    free(store->segments);
+    store->segments = NULL;
+    atomic_store(&store->mappedBytes, 0);
+    store->extentBytes = 0;
+    pthread_mutex_destroy(&store->growLock);
+    pthread_mutex_destroy(&store->commitLock);
+    pthread_cond_destroy(&store->commitDone);
+}
+
+void logstore_close(logstore_t *store)
+{
+    logstoreRelease(store, true);
+}
+
+void logstore_detach(logstore_t *store)
+{
+    logstoreRelease(store, false);
+}
@@ -0,0 +1,311 @@
+/*
+ * logstore.h
+ *
+ * Append-only, memory-mapped storage for the aesdsocket data log.
+ *
+ * The data file stays open and mapped for the life of the server. It grows in
+ * preallocated extents (fallocate) that are mapped into a virtual address range
+ * reserved up front, so the mapping never moves and pointers into it stay valid.
+ * Appends memcpy into the mapping; replays read straight out of it.
+ *
+ * Appends are group committed. A caller queues its packet; if no flush is
+ * running it becomes the flush leader and writes every queued packet as one
+ * batch (one reservation, one watermark publish and, with syncOnCommit, one
+ * msync). Callers that arrive during a flush wait and go out in the next
+ * batch. Packets land in the order their callers queued them.
+ *
+ * Readers never lock. logstore_size() only moves once a whole batch is
+ * copied, so it is always a packet boundary and [0, logstore_size()) can be
+ * streamed while writers continue.
+ *
+ * Extents are preallocated past the end of the file (FALLOC_FL_KEEP_SIZE); the
+ * file itself is extended one batch at a time just before the batch is written,
+ * so its length only ever covers packets that were committed or being written
+ * at a crash, never a zero-filled extent. logstore_close() releases the unused
+ * preallocation.
+ *
+ * Packets too large to hold in memory are built in a stage: an unlinked file
+ * in the log's directory that the caller writes in bounded chunks. The flush
+ * leader reads a staged packet straight into the log mapping, so it lands in
+ * one batch like any other append and readers never see part of it.
+ *
+ * With a retention policy the log keeps only a window of recent packets. The
+ * file becomes a fixed size ring (the window limit plus one spare segment),
+ * mapped twice back to back so any window is contiguous in memory. Offsets
+ * stay logical and keep growing; logstore_start() is where the window begins.
+ * Old packets are dropped a segment (a run of packets filling a fraction of the
+ * window) at a time by moving the window start past them; nothing is copied or
+ * rewritten. Disk use, page cache and the longest
+ * replay are all bounded by the ring size. Once the spare segment is used up,
+ * bytes that slipped out of the window are overwritten, so replays from a ring
+ * go through logstore_replay_chunk(): it copies each chunk into a snapshot and
+ * only hands it out if the ring hadn't reached it by the end of the copy.
+ */
+
+#ifndef LOGSTORE_H
+#define LOGSTORE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "queue.h"
+
+#define LOGSTORE_EXTENT_BYTES (1024 * 1024)
+#define LOGSTORE_DEFAULT_RETAIN_BYTES ((size_t) 64 * 1024 * 1024)
+#define LOGSTORE_SNAPSHOT_BYTES (64 * 1024)
+
+/**
+ * Retention policy. All zero keeps the whole log.
+ */
+typedef struct logstore_retention_s {
+    size_t maxBytes;        // Window size; LOGSTORE_DEFAULT_RETAIN_BYTES if only the other limits are set
+    uint64_t maxRecords;    // Packets kept, 0 for no limit
+    unsigned maxAgeSec;     // Packets older than this are dropped, 0 for no limit. Checked on each append.
+} logstore_retention_t;
+
+/**
+ * One retention segment: a run of whole packets, closed once it holds segmentBytes (or segmentRecords, or
+ * spans segmentSec).
+ * It ends where the next one starts.
+ */
+typedef struct logstore_segment_s {
+    size_t firstPacket;     // Offset of its first packet
+    uint64_t records;       // Packets in it
+    time_t oldest;          // CLOCK_MONOTONIC seconds of the first append to it
+    time_t newest;          // and of the last
+} logstore_segment_t;
+
+/**
+ * Log state handed from one process to the next on a zero-downtime restart (see handoff.h), captured once no
+ * appends are in flight
+ */
+typedef struct logstore_handoff_s {
+    logstore_retention_t retention; // Policy the ring was sized for; all zero for a plain log
+    size_t committed;
+    size_t start;
+    size_t reclaimed;
+    uint64_t retainedRecords;
+    size_t segmentCount;
+    logstore_segment_t *segments;   // segmentCount retained segments, oldest first
+} logstore_handoff_t;
+
+/**
+ * A replay's private copy of the ring bytes it is sending (see logstore_replay_chunk()). Zero-initialize it;
+ * plain logs never fill it.
+ */
+typedef struct logstore_snapshot_s {
+    char *buf;
+    size_t capacity;
+    size_t start;   // Log offset of buf[0]
+    size_t len;     // Bytes in buf, checked intact when copied
+} logstore_snapshot_t;
+
+/**
+ * Staging file for one packet being received in pieces
+ */
+typedef struct logstore_stage_s {
+    int fd;
+    size_t len; // Bytes staged so far
+} logstore_stage_t;
+
+/**
+ * One queued append. Lives on the submitting thread's stack until it is done.
+ */
+typedef struct logstore_commit_s {
+    const logstore_stage_t *stage; // Staged leading part of the packet, or NULL
+    const void *data;              // In-memory (trailing) part of the packet
+    size_t len;                    // Total packet bytes, staged ones included
+    ssize_t end;    // Result handed back to the submitter
+    uint64_t queuedNs;             // When it was queued, for the commit wait histogram
+    bool done;
+    STAILQ_ENTRY(logstore_commit_s) entries;
+} logstore_commit_t;
+
+STAILQ_HEAD(logstore_commit_queue, logstore_commit_s);
+
+/**
+ * Group commit counters, totals since open
+ */
+typedef struct logstore_stats_s {
+    uint64_t batches;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t maxBatchPackets;
+    uint64_t flushNsTotal;
+    uint64_t flushNsMax;
+    uint64_t droppedBytes;  // Bytes that left the retention window
+} logstore_stats_t;
+
+typedef struct logstore_s {
+    int fd;
+    /**
+     * Directory holding the log; stages are created here so they share its filesystem
+     */
+    char *dir;
+    /**
+     * Start of the reserved address range; the file is mapped from here
+     */
+    char *base;
+    /**
+     * Size of the reserved address range, the hard limit on log size
+     */
+    size_t reserveBytes;
+    /**
+     * Bytes of the file that are allocated and mapped, a multiple of extentBytes
+     */
+    _Atomic size_t mappedBytes;
+    size_t extentBytes;
+    /**
+     * End of the last flushed batch; the readable log size. Only the flush leader advances it.
+     */
+    _Atomic size_t committed;
+    /**
+     * Retention (ringBytes != 0 when a policy is set). Only the flush leader writes these.
+     */
+    logstore_retention_t retention;
+    size_t ringBytes;
+    size_t segmentBytes;
+    uint64_t segmentRecords;        // 0 without a record limit
+    unsigned segmentSec;            // 0 without an age limit
+    logstore_segment_t *segments;   // FIFO of the retained segments, oldest at segmentHead
+    size_t numSegments;
+    size_t segmentHead;
+    size_t segmentCount;
+    uint64_t retainedRecords;
+    /**
+     * First offset of the retention window; 0 without retention. Always a packet boundary.
+     */
+    _Atomic size_t start;
+    /**
+     * Bytes below this offset may have been overwritten by the ring
+     */
+    _Atomic size_t reclaimed;
+    /**
+     * Serializes extent allocation and mapping
+     */
+    pthread_mutex_t growLock;
+    /**
+     * msync each batch before its submitters return, making appends durable rather than just visible
+     */
+    bool syncOnCommit;
+    /**
+     * Protects pending, flushing and stats
+     */
+    pthread_mutex_t commitLock;
+    pthread_cond_t commitDone;
+    struct logstore_commit_queue pending;
+    bool flushing;
+    logstore_stats_t stats;
+} logstore_t;
+
+/**
+ * @brief Opens (creating if needed) the log at path and maps any existing contents. With a retention policy
+ *          (retention not NULL and any limit set) the log is a ring and starts out empty.
+ * @return 0 on success, -1 on failure.
+ */
+int logstore_open(logstore_t *store, const char *path, size_t extentBytes, const logstore_retention_t *retention);
+
+/**
+ * @brief Takes over a log another process handed off: fd is the open log file, state describes it. The
+ *          retention policy in state replaces any the caller would have asked for. Closes fd on failure.
+ * @return 0 on success, -1 on failure.
+ */
+int logstore_adopt(logstore_t *store, int fd, const char *path, size_t extentBytes, const logstore_handoff_t *state);
+
+/**
+ * @brief Captures the log's state for logstore_adopt() in another process. No appends may be in flight.
+ *          state->segments is allocated; the caller frees it.
+ * @return 0 on success, -1 on failure.
+ */
+int logstore_export(logstore_t *store, logstore_handoff_t *state);
+
+/**
+ * @brief Appends len bytes from data as one unit, batched with concurrent appends. Returns once the bytes
+ *          are visible to readers (and on disk, if syncOnCommit is set).
+ * @return The log offset just past this append, or -1 on failure (nothing is appended). A packet larger
+ *          than the retention window is never appended.
+ */
+ssize_t logstore_append(logstore_t *store, const void *data, size_t len);
+
+/**
+ * @brief Opens an empty stage for a packet that will be received in pieces
+ * @return 0 on success, -1 on failure.
+ */
+int logstore_stage_open(logstore_t *store, logstore_stage_t *stage);
+
+/**
+ * @brief Adds len bytes to the end of the staged packet
+ * @return 0 on success, -1 on failure.
+ */
+int logstore_stage_write(logstore_stage_t *stage, const void *data, size_t len);
+
+/**
+ * @brief Appends the staged bytes followed by tail[0, tailLen) as one packet, like logstore_append(), and
+ *          empties the stage for the next packet
+ * @return The log offset just past this append, or -1 on failure (nothing is appended).
+ */
+ssize_t logstore_append_staged(logstore_t *store, logstore_stage_t *stage, const void *tail, size_t tailLen);
+
+/**
+ * @brief Releases the stage and anything still staged. Safe to call on a closed stage (fd -1).
+ */
+void logstore_stage_close(logstore_stage_t *stage);
+
+/**
+ * @return Number of committed bytes in the log. Always falls on a packet boundary.
+ */
+size_t logstore_size(logstore_t *store);
+
+/**
+ * @return Offset of the oldest retained byte (0 without retention). Always falls on a packet boundary.
+ */
+size_t logstore_start(logstore_t *store);
+
+/**
+ * @brief Copies the group commit counters
+ */
+void logstore_get_stats(logstore_t *store, logstore_stats_t *stats);
+
+/**
+ * @return Pointer to log offset off. Bytes from there up to logstore_size() may be read directly, provided
+ *          off was at or above logstore_start() when the read began.
+ */
+const char *logstore_at(logstore_t *store, size_t off);
+
+/**
+ * @return false if log bytes from off on may have been overwritten since off was in the retention window.
+ *          Only meaningful after an acquire fence that follows the reads it vouches for.
+ */
+bool logstore_intact(logstore_t *store, size_t off);
+
+/**
+ * @brief Finds the next bytes to send of a replay at log offset off that ends at end. A plain log hands out
+ *          its mapping directly; a ring first copies up to LOGSTORE_SNAPSHOT_BYTES into snap and checks that
+ *          the ring hadn't overwritten them by the end of the copy.
+ * @arg len set to how many bytes from the returned pointer to send
+ * @return Pointer to the bytes, valid until the next call with snap; NULL if they were overwritten (or memory
+ *          ran out), and the replay must be abandoned.
+ */
+const char *logstore_replay_chunk(logstore_t *store, logstore_snapshot_t *snap, size_t off, size_t end, size_t *len);
+
+/**
+ * @brief Frees the snapshot's buffer
+ */
+void logstore_snapshot_release(logstore_snapshot_t *snap);
+
+/**
+ * @brief Unmaps the log, trims the file to the log size and closes it.
+ *          Safe to call on a zeroed or already closed store.
+ */
+void logstore_close(logstore_t *store);
+
+/**
+ * @brief Unmaps the log and closes it, leaving the file exactly as it is for the process it was handed to
+ */
+void logstore_detach(logstore_t *store);
+
+#endif /* LOGSTORE_H */
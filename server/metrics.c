@@ -0,0 +1,408 @@
+/**
+ * @file metrics.c
+ * @brief Per-thread counters and histograms for aesdsocket, and the stats socket. See metrics.h.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "queue.h"
+
+#define METRICS_SUB_BUCKET_BITS (3)
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+// Values below METRICS_SUB_BUCKETS get a bucket each, then METRICS_SUB_BUCKETS per power of two up to 2^64
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS)
+#define METRICS_RENDER_BYTES (8192)
+
+typedef struct metrics_hist_s {
+    _Atomic uint64_t buckets[METRICS_BUCKETS];
+    _Atomic uint64_t sumNs;
+    _Atomic uint64_t maxNs;
+} metrics_hist_t;
+
+typedef struct metrics_shard_s {
+    // Only the owning thread writes these
+    _Atomic uint64_t counters[METRIC_NUM_COUNTERS];
+    metrics_hist_t hists[METRIC_NUM_HISTOGRAMS];
+    LIST_ENTRY(metrics_shard_s) entries;
+} metrics_shard_t;
+
+/**
+ * Plain copy of a shard, used for the exited-thread totals and for rendering
+ */
+typedef struct metrics_totals_s {
+    uint64_t counters[METRIC_NUM_COUNTERS];
+    struct {
+        uint64_t buckets[METRICS_BUCKETS];
+        uint64_t sumNs;
+        uint64_t maxNs;
+    } hists[METRIC_NUM_HISTOGRAMS];
+} metrics_totals_t;
+
+static pthread_once_t shardKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t shardKey;
+static _Thread_local metrics_shard_t *threadShard;
+
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(metrics_shard_list, metrics_shard_s) liveShards = LIST_HEAD_INITIALIZER(liveShards);
+static metrics_totals_t exitedTotals;
+
+static _Atomic uint64_t gauges[METRIC_NUM_GAUGES];
+
+static const char *counterNames[METRIC_NUM_COUNTERS] = {
+    [METRIC_ACCEPTS] = "aesdsocket_accepts_total",
+    [METRIC_CLOSES] = "aesdsocket_closes_total",
+    [METRIC_BYTES_IN] = "aesdsocket_bytes_in_total",
+    [METRIC_BYTES_OUT] = "aesdsocket_bytes_out_total",
+    [METRIC_PACKETS] = "aesdsocket_packets_appended_total",
+};
+
+static const char *histNames[METRIC_NUM_HISTOGRAMS] = {
+    [METRIC_HIST_LOG_WAIT] = "aesdsocket_log_lock_wait_ns",
+    [METRIC_HIST_LOG_HOLD] = "aesdsocket_log_lock_hold_ns",
+    [METRIC_HIST_REPLAY] = "aesdsocket_recv_to_replay_ns",
+};
+
+static const char *gaugeNames[METRIC_NUM_GAUGES] = {
+    [METRIC_GAUGE_LOG_BYTES] = "aesdsocket_log_bytes",
+};
+
+// Stats socket server
+static int serverFd = -1;
+static pthread_t serverThread;
+static char *serverPath;
+static struct stat serverStat; // Identifies our socket file, so a successor's (see handoff.h) is left alone
+static atomic_bool serverStopping;
+
+static inline void shardInc(_Atomic uint64_t *value, uint64_t n)
+{
+    // Single writer, so a relaxed load + store is enough and avoids a locked instruction
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * @brief Adds a shard's values into totals
+ */
+static void shardAccumulate(metrics_totals_t *totals, metrics_shard_t *shard)
+{
+    for(int c = 0; c < METRIC_NUM_COUNTERS; c++){
+        totals->counters[c] += atomic_load_explicit(&shard->counters[c], memory_order_relaxed);
+    }
+    for(int h = 0; h < METRIC_NUM_HISTOGRAMS; h++){
+        for(int b = 0; b < METRICS_BUCKETS; b++){
+            totals->hists[h].buckets[b] += atomic_load_explicit(&shard->hists[h].buckets[b], memory_order_relaxed);
+        }
+        totals->hists[h].sumNs += atomic_load_explicit(&shard->hists[h].sumNs, memory_order_relaxed);
+        uint64_t maxNs = atomic_load_explicit(&shard->hists[h].maxNs, memory_order_relaxed);
+        if(maxNs > totals->hists[h].maxNs){
+            totals->hists[h].maxNs = maxNs;
+        }
+    }
+}
+
+/**
+ * @brief Thread exit destructor: folds the shard into exitedTotals
+ */
+static void shardDestroy(void *arg)
+{
+    metrics_shard_t *shard = arg;
+
+    pthread_mutex_lock(&registryLock);
+    LIST_REMOVE(shard, entries);
+    shardAccumulate(&exitedTotals, shard);
+    pthread_mutex_unlock(&registryLock);
+
+    free(shard);
+    threadShard = NULL;
+}
+
+static void shardKeyCreate(void)
+{
+    pthread_key_create(&shardKey, shardDestroy);
+}
+
+/**
+ * @return This thread's shard, created on first use, or NULL if it couldn't be allocated
+ */
+static metrics_shard_t *shardGet(void)
+{
+    if(threadShard != NULL){
+        return threadShard;
+    }
+
+    pthread_once(&shardKeyOnce, shardKeyCreate);
+    metrics_shard_t *shard = calloc(1, sizeof(*shard));
+    if(shard == NULL){
+        return NULL;
+    }
+
+    pthread_mutex_lock(&registryLock);
+    LIST_INSERT_HEAD(&liveShards, shard, entries);
+    pthread_mutex_unlock(&registryLock);
+
+    pthread_setspecific(shardKey, shard);
+    threadShard = shard;
+    return shard;
+}
+
+/**
+ * @return Histogram bucket holding ns
+ */
+static inline unsigned bucketFor(uint64_t ns)
+{
+    if(ns < METRICS_SUB_BUCKETS){
+        return ns;
+    }
+    unsigned exp = 63 - __builtin_clzll(ns); // >= METRICS_SUB_BUCKET_BITS
+    unsigned sub = (ns >> (exp - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return (exp - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+/**
+ * @return Largest value that lands in bucket
+ */
+static uint64_t bucketUpperBound(unsigned bucket)
+{
+    if(bucket < METRICS_SUB_BUCKETS){
+        return bucket;
+    }
+    unsigned exp = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BUCKET_BITS - 1;
+    uint64_t sub = bucket % METRICS_SUB_BUCKETS;
+    uint64_t width = (uint64_t) 1 << (exp - METRICS_SUB_BUCKET_BITS);
+    return ((METRICS_SUB_BUCKETS + sub) << (exp - METRICS_SUB_BUCKET_BITS)) + width - 1;
+}
+
+void metrics_add(metric_counter_t counter, uint64_t n)
+{
+    metrics_shard_t *shard = shardGet();
+    if(shard != NULL){
+        shardInc(&shard->counters[counter], n);
+    }
+}
+
+void metrics_observe(metric_hist_t hist, uint64_t ns)
+{
+    metrics_shard_t *shard = shardGet();
+    if(shard == NULL){
+        return;
+    }
+
+    metrics_hist_t *h = &shard->hists[hist];
+    shardInc(&h->buckets[bucketFor(ns)], 1);
+    shardInc(&h->sumNs, ns);
+    if(ns > atomic_load_explicit(&h->maxNs, memory_order_relaxed)){
+        atomic_store_explicit(&h->maxNs, ns, memory_order_relaxed);
+    }
+}
+
+void metrics_set(metric_gauge_t gauge, uint64_t value)
+{
+    atomic_store_explicit(&gauges[gauge], value, memory_order_relaxed);
+}
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * @return Upper bound of the bucket holding quantile q of the histogram, capped at its max
+ */
+static uint64_t histQuantile(const uint64_t *buckets, uint64_t count, uint64_t maxNs, double q)
+{
+    if(count == 0){
+        return 0;
+    }
+
+    // Rank of the observation at quantile q, 1-based
+    uint64_t rank = (uint64_t) (q * count);
+    if(rank < q * count || rank == 0){
+        rank++;
+    }
+
+    uint64_t seen = 0;
+    for(unsigned b = 0; b < METRICS_BUCKETS; b++){
+        seen += buckets[b];
+        if(seen >= rank){
+            uint64_t upper = bucketUpperBound(b);
+            return upper < maxNs ? upper : maxNs;
+        }
+    }
+    return maxNs;
+}
+
+/**
+ * @brief Renders every metric as "name value" lines
+ * @return Bytes written to buf (always less than cap).
+ */
+static size_t metricsRender(char *buf, size_t cap)
+{
+    static metrics_totals_t totals; // Large; only the server thread renders
+    memset(&totals, 0, sizeof(totals));
+
+    pthread_mutex_lock(&registryLock);
+    memcpy(&totals, &exitedTotals, sizeof(totals));
+    metrics_shard_t *shard;
+    LIST_FOREACH(shard, &liveShards, entries){
+        shardAccumulate(&totals, shard);
+    }
+    pthread_mutex_unlock(&registryLock);
+
+    size_t len = 0;
+#define EMIT(...) do { \
+        int n = snprintf(buf + len, cap - len, __VA_ARGS__); \
+        if(n > 0){ len += (size_t) n < cap - len ? (size_t) n : cap - len - 1; } \
+    } while(0)
+
+    for(int c = 0; c < METRIC_NUM_COUNTERS; c++){
+        EMIT("%s %llu\n", counterNames[c], (unsigned long long) totals.counters[c]);
+    }
+    uint64_t active = totals.counters[METRIC_ACCEPTS] - totals.counters[METRIC_CLOSES];
+    EMIT("aesdsocket_connections_active %llu\n", (unsigned long long) active);
+    for(int g = 0; g < METRIC_NUM_GAUGES; g++){
+        EMIT("%s %llu\n", gaugeNames[g], (unsigned long long) atomic_load(&gauges[g]));
+    }
+
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    static const char *quantileLabels[] = {"0.5", "0.99", "0.999"};
+    for(int h = 0; h < METRIC_NUM_HISTOGRAMS; h++){
+        uint64_t count = 0;
+        for(unsigned b = 0; b < METRICS_BUCKETS; b++){
+            count += totals.hists[h].buckets[b];
+        }
+        for(int q = 0; q < 3; q++){
+            EMIT("%s{quantile=\"%s\"} %llu\n", histNames[h], quantileLabels[q],
+                 (unsigned long long) histQuantile(totals.hists[h].buckets, count, totals.hists[h].maxNs, quantiles[q]));
+        }
+        EMIT("%s_max %llu\n", histNames[h], (unsigned long long) totals.hists[h].maxNs);
+        EMIT("%s_sum %llu\n", histNames[h], (unsigned long long) totals.hists[h].sumNs);
+        EMIT("%s_count %llu\n", histNames[h], (unsigned long long) count);
+    }
+#undef EMIT
+
+    return len;
+}
+
+/**
+ * @brief Stats server thread: answers each connection with the current metrics, then closes it
+ */
+static void *metricsServerThread(void *arg)
+{
+    (void) arg;
+
+    char *buf = malloc(METRICS_RENDER_BYTES);
+    if(buf == NULL){
+        return NULL;
+    }
+
+    while(!atomic_load(&serverStopping)){
+        int clientfd = accept(serverFd, NULL, NULL);
+        if(clientfd == -1){
+            if(errno != EINTR && !atomic_load(&serverStopping)){
+                perror("metrics accept");
+            }
+            continue;
+        }
+
+        size_t len = metricsRender(buf, METRICS_RENDER_BYTES);
+        size_t sent = 0;
+        while(sent < len){
+            ssize_t n = send(clientfd, buf + sent, len - sent, MSG_NOSIGNAL);
+            if(n <= 0){
+                if(n < 0 && errno == EINTR){
+                    continue;
+                }
+                break;
+            }
+            sent += n;
+        }
+        close(clientfd);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+int metrics_server_start(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "Stats socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    serverFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(serverFd == -1){
+        perror("stats socket");
+        return -1;
+    }
+
+    unlink(path); // Left behind by an earlier run
+    if(bind(serverFd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(serverFd, 8) == -1 ||
+       stat(path, &serverStat) == -1){
+        perror("stats socket bind");
+        close(serverFd);
+        serverFd = -1;
+        return -1;
+    }
+
+    serverPath = strdup(path);
+    atomic_store(&serverStopping, false);
+
+    // Leave signals to the serving threads; they rely on SIGINT/SIGTERM interrupting their own calls
+    sigset_t blocked, previous;
+    sigfillset(&blocked);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    int rc = pthread_create(&serverThread, NULL, metricsServerThread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if(rc != 0){
+        perror("pthread_create stats server");
+        free(serverPath);
+        serverPath = NULL;
+        metrics_server_stop();
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_server_stop(void)
+{
+    if(serverFd == -1){
+        return;
+    }
+
+    // Shutting the listener down makes the blocked accept() return
+    atomic_store(&serverStopping, true);
+    if(serverPath != NULL){
+        shutdown(serverFd, SHUT_RDWR);
+        pthread_join(serverThread, NULL);
+    }
+    close(serverFd);
+    serverFd = -1;
+
+    if(serverPath != NULL){
+        struct stat st;
+        if(stat(serverPath, &st) == 0 && st.st_ino == serverStat.st_ino && st.st_dev == serverStat.st_dev){
+            unlink(serverPath);
+        }
+        free(serverPath);
+        serverPath = NULL;
+    }
+}
@@ -0,0 +1,73 @@
+/*
+ * metrics.h
+ *
+ * Counters and latency histograms for aesdsocket, served as plain text on a
+ * local Unix socket (-p <path>): connect, read until EOF.
+ *
+ * Every thread records into its own shard, which only that thread writes, so
+ * recording is a relaxed load and store with no locked instructions and no
+ * shared cache lines. Readers sum the shards of live threads plus the totals
+ * left behind by exited ones.
+ *
+ * Histograms are log-linear: eight buckets per power of two, so a reported
+ * quantile is at most 12.5% above the true value.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+typedef enum {
+    METRIC_ACCEPTS,         // Connections accepted
+    METRIC_CLOSES,          // Connections closed; accepts - closes is the active count
+    METRIC_BYTES_IN,        // Bytes received from clients
+    METRIC_BYTES_OUT,       // Replay bytes sent to clients
+    METRIC_PACKETS,         // Packets appended to the log
+    METRIC_NUM_COUNTERS
+} metric_counter_t;
+
+typedef enum {
+    METRIC_HIST_LOG_WAIT,   // Append queued until its group commit batch starts flushing
+    METRIC_HIST_LOG_HOLD,   // Batch flush, the time the log is held exclusively
+    METRIC_HIST_REPLAY,     // Packet received until its replay has been fully sent
+    METRIC_NUM_HISTOGRAMS
+} metric_hist_t;
+
+typedef enum {
+    METRIC_GAUGE_LOG_BYTES, // Committed log size
+    METRIC_NUM_GAUGES
+} metric_gauge_t;
+
+/**
+ * @brief Adds n to a counter
+ */
+void metrics_add(metric_counter_t counter, uint64_t n);
+
+/**
+ * @brief Records one observation, in nanoseconds, in a histogram
+ */
+void metrics_observe(metric_hist_t hist, uint64_t ns);
+
+/**
+ * @brief Sets a gauge. Gauges are process wide, last writer wins.
+ */
+void metrics_set(metric_gauge_t gauge, uint64_t value);
+
+/**
+ * @return CLOCK_MONOTONIC time in nanoseconds, for timing histogram observations
+ */
+uint64_t metrics_now_ns(void);
+
+/**
+ * @brief Starts a thread serving the metrics text on a Unix socket at path (replacing a stale socket file)
+ * @return 0 on success, -1 on failure.
+ */
+int metrics_server_start(const char *path);
+
+/**
+ * @brief Stops the metrics server and removes its socket file. Safe to call if it never started.
+ */
+void metrics_server_stop(void);
+
+#endif /* METRICS_H */
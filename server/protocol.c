@@ -0,0 +1,53 @@
+/**
+ * @file protocol.c
+ * @brief Wire protocol extensions for aesdsocket. See protocol.h.
+ *
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/**
+ * @brief Parses a replay cursor line at the start of data
+ * @return Length of the line including its newline, or 0 if data doesn't start with a well formed one.
+ */
+static size_t protocolParseReplayFrom(const void *data, size_t len, size_t *offset)
+{
+    const char *p = data;
+    size_t prefixLen = sizeof(PROTOCOL_REPLAY_FROM_CMD) - 1;
+    if(len <= prefixLen || memcmp(p, PROTOCOL_REPLAY_FROM_CMD, prefixLen) != 0){
+        return 0;
+    }
+
+    // Decimal offset, at least one digit, directly followed by the newline
+    size_t value = 0;
+    size_t i = prefixLen;
+    for(; i < len && p[i] >= '0' && p[i] <= '9'; i++){
+        size_t digit = p[i] - '0';
+        if(value > (SIZE_MAX - digit) / 10){
+            return 0; // Too large to be an offset; treat the line as ordinary data
+        }
+        value = value * 10 + digit;
+    }
+    if(i == prefixLen || i == len || p[i] != '\n'){
+        return 0;
+    }
+
+    *offset = value;
+    return i + 1;
+}
+
+size_t protocol_apply_replay_from(protocol_cursor_t *cursor, const void *data, size_t len, size_t logSize)
+{
+    size_t offset;
+    size_t lineLen = protocolParseReplayFrom(data, len, &offset);
+    if(lineLen == 0){
+        return 0;
+    }
+
+    cursor->incremental = true;
+    cursor->offset = offset < logSize ? offset : logSize;
+    return lineLen;
+}
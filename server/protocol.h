@@ -0,0 +1,62 @@
+/*
+ * protocol.h
+ *
+ * Wire protocol extensions understood by every aesdsocket serving model.
+ *
+ * Replay cursor: a client that already holds the first <offset> bytes of the
+ * log sends the line
+ *
+ *     AESDSOCKET_REPLAYFROM:<offset>\n
+ *
+ * The line is not appended. The server answers it with the log from <offset>
+ * (clamped to the log size) and from then on answers each packet on that
+ * connection with only the bytes the client has not been sent yet. Everything
+ * a cursor client receives is therefore the contiguous log starting at
+ * <offset>. Clients that never send the line keep getting the full log.
+ *
+ * When the log only retains a window of recent packets, replays never start
+ * before the window, so a cursor client that fell further behind than the
+ * window misses the packets dropped in between. A window smaller than the
+ * number of concurrent writers can even drop a packet before its own replay.
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define PROTOCOL_REPLAY_FROM_CMD "AESDSOCKET_REPLAYFROM:"
+
+/**
+ * Where a connection's next replay starts
+ */
+typedef struct protocol_cursor_s {
+    /**
+     * Set once the client has sent a replay cursor line; until then every replay starts at 0
+     */
+    bool incremental;
+    /**
+     * Log bytes below this have already been sent to the client
+     */
+    size_t offset;
+} protocol_cursor_t;
+
+/**
+ * @return Log offset the connection's next replay starts from, no earlier than logStart (the oldest byte the
+ *          log still retains)
+ */
+static inline size_t protocol_replay_start(const protocol_cursor_t *cursor, size_t logStart)
+{
+    size_t start = cursor->incremental ? cursor->offset : 0;
+    return start > logStart ? start : logStart;
+}
+
+/**
+ * @brief If data starts with a complete replay cursor line, switches cursor to incremental replay from the
+ *          requested offset, clamped to logSize
+ * @return Length of the line including its newline, or 0 if data doesn't start with a well formed one.
+ */
+size_t protocol_apply_replay_from(protocol_cursor_t *cursor, const void *data, size_t len, size_t logSize);
+
+#endif /* PROTOCOL_H */
@@ -0,0 +1,103 @@
+/**
+ * @file timestamp.c
+ * @brief timerfd driven timestamp lines for the data log. See timestamp.h.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "timestamp.h"
+
+#define TIMESTAMP_PREFIX "timestamp:"
+
+/**
+ * @brief Renders the whole line for wall clock second now and remembers where its minute began
+ * @return 0 on success, -1 if the line didn't fit.
+ */
+static int timestampRender(timestamp_writer_t *writer, time_t now)
+{
+    struct tm tm;
+    localtime_r(&now, &tm);
+
+    // Split at the seconds so later ticks in this minute know which two digits to patch
+    size_t len = strlen(TIMESTAMP_PREFIX);
+    memcpy(writer->line, TIMESTAMP_PREFIX, len);
+    size_t n = strftime(writer->line + len, sizeof(writer->line) - len, "%a, %d %b %Y %H:%M:", &tm);
+    if(n == 0){
+        return -1;
+    }
+    len += n;
+    writer->secondsOffset = len;
+
+    n = strftime(writer->line + len, sizeof(writer->line) - len, "%S %z", &tm);
+    if(n == 0 || len + n + 1 > sizeof(writer->line)){
+        return -1;
+    }
+    len += n;
+    writer->line[len++] = '\n';
+
+    writer->lineLen = len;
+    writer->minuteStart = now - tm.tm_sec;
+    return 0;
+}
+
+int timestamp_open(timestamp_writer_t *writer, logstore_t *store, unsigned intervalMs)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->store = store;
+    writer->minuteStart = -1;
+
+    writer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(writer->fd == -1){
+        perror("timerfd_create");
+        return -1;
+    }
+
+    struct itimerspec spec = {0};
+    spec.it_interval.tv_sec = intervalMs / 1000;
+    spec.it_interval.tv_nsec = (long) (intervalMs % 1000) * 1000000;
+    spec.it_value = spec.it_interval;
+    if(timerfd_settime(writer->fd, 0, &spec, NULL) == -1){
+        perror("timerfd_settime");
+        close(writer->fd);
+        writer->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void timestamp_tick(timestamp_writer_t *writer)
+{
+    uint64_t expirations;
+    if(read(writer->fd, &expirations, sizeof(expirations)) != sizeof(expirations)){
+        return; // EAGAIN: another wake already drained it
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    time_t now = ts.tv_sec;
+
+    if(writer->minuteStart != -1 && now >= writer->minuteStart && now - writer->minuteStart < 60){
+        // Same minute: only the seconds changed
+        int sec = (int) (now - writer->minuteStart);
+        writer->line[writer->secondsOffset] = '0' + sec / 10;
+        writer->line[writer->secondsOffset + 1] = '0' + sec % 10;
+    } else if(timestampRender(writer, now) == -1){
+        fprintf(stderr, "timestamp line too long\n");
+        return;
+    }
+
+    logstore_append(writer->store, writer->line, writer->lineLen);
+}
+
+void timestamp_close(timestamp_writer_t *writer)
+{
+    if(writer->fd != -1){
+        close(writer->fd);
+        writer->fd = -1;
+    }
+}
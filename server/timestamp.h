@@ -0,0 +1,58 @@
+/*
+ * timestamp.h
+ *
+ * Periodic "timestamp:<RFC 2822 time>\n" lines in the data log, driven by a
+ * timerfd that one long-lived poller services (epoll loop 0, io_uring ring 0,
+ * or in pool mode a thread of its own), so no thread is started per expiry.
+ *
+ * The rendered line is cached. A tick within the same wall clock minute only
+ * rewrites the two seconds digits; the rest is re-rendered (localtime_r and
+ * strftime) once a minute, or when the clock jumps. Lines go through
+ * logstore_append like any packet, so they join the current group commit.
+ */
+
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <stdint.h>
+#include <time.h>
+#include "logstore.h"
+
+#define TIMESTAMP_LINE_BYTES (64)
+
+typedef struct timestamp_writer_s {
+    int fd;                 // Non-blocking timerfd; -1 when closed
+    logstore_t *store;
+    char line[TIMESTAMP_LINE_BYTES];
+    size_t lineLen;
+    size_t secondsOffset;   // Index of the seconds digits in line
+    time_t minuteStart;     // Wall clock second the cached line's minute began; -1 before the first render
+} timestamp_writer_t;
+
+/**
+ * @brief Creates the timerfd, firing every intervalMs (sub-second intervals are fine) after the first
+ *          intervalMs. Timestamps are appended to store from whichever loop calls timestamp_tick().
+ * @return 0 on success, -1 on failure (writer->fd stays -1).
+ */
+int timestamp_open(timestamp_writer_t *writer, logstore_t *store, unsigned intervalMs);
+
+/**
+ * @return The timerfd to poll for readability, or -1
+ */
+static inline int timestamp_fd(const timestamp_writer_t *writer)
+{
+    return writer->fd;
+}
+
+/**
+ * @brief Call when the timerfd is readable. Drains it and appends one timestamp line, however many
+ *          expirations were missed.
+ */
+void timestamp_tick(timestamp_writer_t *writer);
+
+/**
+ * @brief Closes the timerfd. No further timestamps are appended.
+ */
+void timestamp_close(timestamp_writer_t *writer);
+
+#endif /* TIMESTAMP_H */
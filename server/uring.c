@@ -0,0 +1,993 @@
+/**
+ * @file uring.c
+ * @brief io_uring serving model for aesdsocket. See uring.h.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "protocol.h"
+#include "bufpool.h"
+#include "framing.h"
+#include "metrics.h"
+#include "dlog.h"
+
+#define URING_ENTRIES (256)
+#define URING_RECV_BUFFERS (64) // Must be a power of two
+#define URING_RECV_BUFFER_BYTES (4096)
+#define URING_BUFFER_GROUP (0)
+#define URING_LISTEN_SLOT (0) // Index of the listener in the registered file table
+#define URING_MAX_RINGS (256)
+#define URING_MAX_SEND_BYTES ((size_t) 1 << 30)
+
+// Low bits of user_data say which operation completed; the rest is the connection pointer
+typedef enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_WAKE,      // Poll on the shutdown eventfd
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_CLOSE,
+    URING_OP_TIMEOUT,   // Keep-alive idle timeout linked to a recv
+    URING_OP_TIMER,     // Poll on the timestamp timerfd
+} uring_op_t;
+#define URING_OP_MASK (0x7)
+
+typedef struct uring_conn_s {
+    int fd;
+    uint8_t *buffer;
+    size_t bufferCapacity;
+    size_t totalBytesRecvd; // Bytes buffered and not yet appended
+    size_t scanned;         // Leading bytes of the buffer already searched for a newline
+    bool peerClosed;
+    logstore_stage_t stage; // Leading part of an oversized packet
+    protocol_cursor_t cursor;
+    bool replayingCursorLine; // The send in progress answers a cursor line, not a packet
+    uint64_t packetNs;        // When the packet being answered was appended, for the replay latency histogram
+    size_t replayOffset;
+    size_t replayEnd;
+    logstore_snapshot_t snapshot; // Ring bytes being replayed; must outlive the send reading them
+} uring_conn_t;
+
+typedef struct uring_loop_s {
+    int fd;
+    // Submission ring
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqLocalTail;   // SQEs filled in but not yet published to the kernel
+    unsigned sqEntries;
+    // Completion ring
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    // Mappings to release
+    void *sqRingPtr;
+    size_t sqRingBytes;
+    void *cqRingPtr;
+    size_t cqRingBytes;
+    size_t sqesBytes;
+    // Provided receive buffers
+    struct io_uring_buf_ring *bufRing;
+    size_t bufRingBytes;
+    char *bufBase;
+    // Shared server state
+    logstore_t *store;
+    int shutdownfd;
+    volatile int *endProgram;
+    bool keepAlive;
+    struct __kernel_timespec idleTimeout;
+    bool stallDeadline;
+    struct __kernel_timespec stallTimeout;
+    size_t spillThresholdBytes;
+    size_t maxPacketBytes;
+    timestamp_writer_t *timestamps; // Ring 0 only
+    volatile int *drainOnStop;
+    struct __kernel_timespec drainTimeout;
+    bool draining;          // Accept cancelled; stop once it has ended and liveConns is 0, or drainTimeout passes
+    bool acceptEnded;       // The cancelled accept posted its last completion; no more connections arrive
+    unsigned liveConns;
+    bool stopping;
+} uring_loop_t;
+
+static int uringSetup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uringEnterRaw(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int uringRegister(int fd, unsigned opcode, void *arg, unsigned nrArgs)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+static inline uint64_t uringTag(uring_conn_t *conn, uring_op_t op)
+{
+    return (uint64_t) (uintptr_t) conn | op;
+}
+
+/**
+ * @brief Publishes filled SQEs and enters the kernel, optionally waiting for completions
+ * @return 0 on success, -1 on failure (errno set).
+ */
+static int uringSubmit(uring_loop_t *loop, unsigned minComplete)
+{
+    __atomic_store_n(loop->sqTail, loop->sqLocalTail, __ATOMIC_RELEASE);
+    unsigned pending = loop->sqLocalTail - __atomic_load_n(loop->sqHead, __ATOMIC_ACQUIRE);
+
+    int rc = uringEnterRaw(loop->fd, pending, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0);
+    return rc < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Makes sure count SQEs can be filled in without a flush in between, so a linked chain
+ *          reaches the kernel in one submission
+ * @return 0 on success, -1 if no room could be made.
+ */
+static int uringReserve(uring_loop_t *loop, unsigned count)
+{
+    if(loop->sqLocalTail - __atomic_load_n(loop->sqHead, __ATOMIC_ACQUIRE) + count > loop->sqEntries){
+        if(uringSubmit(loop, 0) == -1 && errno != EINTR && errno != EBUSY){
+            return -1;
+        }
+        if(loop->sqLocalTail - __atomic_load_n(loop->sqHead, __ATOMIC_ACQUIRE) + count > loop->sqEntries){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns a zeroed SQE to fill in, flushing the ring to the kernel first if it is full
+ * @return Pointer to the SQE, or NULL if no room could be made.
+ */
+static struct io_uring_sqe *uringGetSqe(uring_loop_t *loop)
+{
+    if(uringReserve(loop, 1) == -1){
+        return NULL;
+    }
+
+    unsigned index = loop->sqLocalTail & loop->sqMask;
+    struct io_uring_sqe *sqe = &loop->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    loop->sqArray[index] = index;
+    loop->sqLocalTail++;
+    return sqe;
+}
+
+/**
+ * @brief Hands receive buffer bid back to the kernel
+ */
+static void uringRecycleBuffer(uring_loop_t *loop, unsigned short bid)
+{
+    unsigned short tail = loop->bufRing->tail;
+    struct io_uring_buf *buf = &loop->bufRing->bufs[tail & (URING_RECV_BUFFERS - 1)];
+    buf->addr = (uintptr_t) (loop->bufBase + (size_t) bid * URING_RECV_BUFFER_BYTES);
+    buf->len = URING_RECV_BUFFER_BYTES;
+    buf->bid = bid;
+    __atomic_store_n(&loop->bufRing->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uringArmAccept(uring_loop_t *loop)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(loop);
+    if(sqe == NULL){
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = URING_LISTEN_SLOT;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = uringTag(NULL, URING_OP_ACCEPT);
+    return 0;
+}
+
+static int uringArmWake(uring_loop_t *loop)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(loop);
+    if(sqe == NULL){
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->shutdownfd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uringTag(NULL, URING_OP_WAKE);
+    return 0;
+}
+
+/**
+ * @brief Polls the timestamp timerfd once; re-armed after each tick
+ */
+static int uringArmTimer(uring_loop_t *loop)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(loop);
+    if(sqe == NULL){
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = timestamp_fd(loop->timestamps);
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uringTag(NULL, URING_OP_TIMER);
+    return 0;
+}
+
+/**
+ * @brief Links a timeout to sqe, the last SQE taken; if sqe hasn't completed by then it completes with
+ *          -ECANCELED. The caller must have reserved room for the extra SQE.
+ */
+static void uringLinkTimeout(uring_loop_t *loop, struct io_uring_sqe *sqe, struct __kernel_timespec *ts)
+{
+    sqe->flags |= IOSQE_IO_LINK;
+    struct io_uring_sqe *timeout = uringGetSqe(loop);
+    timeout->opcode = IORING_OP_LINK_TIMEOUT;
+    timeout->fd = -1;
+    timeout->addr = (uintptr_t) ts;
+    timeout->len = 1;
+    timeout->user_data = uringTag(NULL, URING_OP_TIMEOUT);
+}
+
+static int uringArmRecv(uring_loop_t *loop, uring_conn_t *conn)
+{
+    if(uringReserve(loop, loop->keepAlive ? 2 : 1) == -1){
+        return -1;
+    }
+    struct io_uring_sqe *sqe = uringGetSqe(loop);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = uringTag(conn, URING_OP_RECV);
+
+    if(loop->keepAlive){
+        uringLinkTimeout(loop, sqe, &loop->idleTimeout);
+    }
+    return 0;
+}
+
+static int uringArmSend(uring_loop_t *loop, uring_conn_t *conn)
+{
+    size_t remaining;
+    const char *chunk = logstore_replay_chunk(loop->store, &conn->snapshot, conn->replayOffset, conn->replayEnd,
+                                              &remaining);
+    if(chunk == NULL){
+        DLOG(LOG_DEBUG, "Replay overtaken by log retention - dropping connection");
+        return -1;
+    }
+    if(uringReserve(loop, loop->stallDeadline ? 2 : 1) == -1){
+        return -1;
+    }
+    struct io_uring_sqe *sqe = uringGetSqe(loop);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t) chunk;
+    sqe->len = remaining > URING_MAX_SEND_BYTES ? URING_MAX_SEND_BYTES : remaining; // len is 32-bit
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uringTag(conn, URING_OP_SEND);
+
+    if(loop->stallDeadline){
+        // Each send completes as soon as the client takes some bytes, so this bounds time without progress
+        uringLinkTimeout(loop, sqe, &loop->stallTimeout);
+    }
+    return 0;
+}
+
+/**
+ * @brief Queues a linked shutdown + close for the connection and frees its state
+ */
+static void uringConnClose(uring_loop_t *loop, uring_conn_t *conn)
+{
+    metrics_add(METRIC_CLOSES, 1);
+    loop->liveConns--;
+    if(uringReserve(loop, 2) == -1){
+        // Ring is wedged; fall back to plain syscalls
+        shutdown(conn->fd, SHUT_RDWR);
+        close(conn->fd);
+    } else {
+        // Both fit, so the link can't be cut in half by a full submission queue
+        struct io_uring_sqe *shut = uringGetSqe(loop);
+        struct io_uring_sqe *cls = uringGetSqe(loop);
+
+        // Hard link: the close must still run if shutdown fails (e.g. the peer already reset)
+        shut->opcode = IORING_OP_SHUTDOWN;
+        shut->fd = conn->fd;
+        shut->len = SHUT_RDWR;
+        shut->flags = IOSQE_IO_HARDLINK;
+        shut->user_data = uringTag(NULL, URING_OP_CLOSE);
+
+        cls->opcode = IORING_OP_CLOSE;
+        cls->fd = conn->fd;
+        cls->user_data = uringTag(NULL, URING_OP_CLOSE);
+    }
+
+    logstore_stage_close(&conn->stage);
+    logstore_snapshot_release(&conn->snapshot);
+    bufpool_put(conn->buffer);
+    free(conn);
+}
+
+/**
+ * @brief Copies received bytes into the connection's packet buffer
+ * @return 0 on success, -1 if the buffer could not grow.
+ */
+static int uringConnBuffer(uring_conn_t *conn, const char *data, size_t len)
+{
+    if(conn->totalBytesRecvd + len > conn->bufferCapacity){
+        uint8_t *temp = bufpool_grow(conn->buffer, conn->totalBytesRecvd, conn->totalBytesRecvd + len,
+                                     &conn->bufferCapacity);
+        if(temp == NULL){
+            printf("Failed to malloc large enough buffer.\n");
+            return -1;
+        }
+        conn->buffer = temp;
+    }
+
+    memcpy(conn->buffer + conn->totalBytesRecvd, data, len);
+    conn->totalBytesRecvd += len;
+    return 0;
+}
+
+static void uringConnReplay(uring_loop_t *loop, uring_conn_t *conn);
+
+/**
+ * @brief Appends the first len buffered bytes as one packet and, if replay is set, starts replaying the log
+ *          to the client. Bytes after the packet stay buffered for the next one.
+ */
+static void uringConnAppend(uring_loop_t *loop, uring_conn_t *conn, size_t len, bool replay)
+{
+    conn->packetNs = metrics_now_ns();
+    ssize_t end = conn->stage.len > 0 ? logstore_append_staged(loop->store, &conn->stage, conn->buffer, len)
+                                      : logstore_append(loop->store, conn->buffer, len);
+
+    conn->totalBytesRecvd -= len;
+    if(conn->totalBytesRecvd == 0){
+        bufpool_put(conn->buffer);
+        conn->buffer = NULL;
+        conn->bufferCapacity = 0;
+    } else {
+        memmove(conn->buffer, conn->buffer + len, conn->totalBytesRecvd);
+    }
+    conn->scanned = 0;
+    if(!replay){
+        return;
+    }
+
+    conn->replayOffset = protocol_replay_start(&conn->cursor, logstore_start(loop->store));
+    conn->replayEnd = end < 0 ? logstore_size(loop->store) : (size_t) end;
+    conn->replayingCursorLine = false;
+    uringConnReplay(loop, conn);
+}
+
+/**
+ * @brief Consumes a replay cursor line at the start of the buffer and starts sending the delta
+ * @return true if there was one.
+ */
+static bool uringConnCursorLine(uring_loop_t *loop, uring_conn_t *conn)
+{
+    if(conn->stage.len > 0){
+        return false; // Mid-packet, so not the start of a line
+    }
+
+    size_t logSize = logstore_size(loop->store);
+    size_t lineLen = protocol_apply_replay_from(&conn->cursor, conn->buffer, conn->totalBytesRecvd, logSize);
+    if(lineLen == 0){
+        return false;
+    }
+
+    conn->totalBytesRecvd -= lineLen;
+    memmove(conn->buffer, conn->buffer + lineLen, conn->totalBytesRecvd);
+    conn->scanned = 0;
+    conn->replayOffset = protocol_replay_start(&conn->cursor, logstore_start(loop->store));
+    conn->replayEnd = logSize;
+    conn->replayingCursorLine = true;
+    uringConnReplay(loop, conn);
+    return true;
+}
+
+/**
+ * @return true, after logging it, if a packet of the staged bytes plus len buffered ones breaks the limit
+ */
+static bool uringPacketTooLarge(uring_loop_t *loop, uring_conn_t *conn, size_t len)
+{
+    if(conn->stage.len + len <= loop->maxPacketBytes){
+        return false;
+    }
+    DLOG(LOG_ERR, "Packet exceeds the %zu byte limit - dropping connection", loop->maxPacketBytes);
+    return true;
+}
+
+/**
+ * @brief Called while the buffer holds only the start of a packet. Enforces the packet limit and moves the
+ *          buffer to the stage once it reaches the spill threshold.
+ * @return 0 on success, -1 if the connection must be dropped.
+ */
+static int uringConnIngestPartial(uring_loop_t *loop, uring_conn_t *conn)
+{
+    if(uringPacketTooLarge(loop, conn, conn->totalBytesRecvd)){
+        return -1;
+    }
+    if(conn->totalBytesRecvd < loop->spillThresholdBytes){
+        return 0;
+    }
+
+    if(conn->stage.fd == -1 && logstore_stage_open(loop->store, &conn->stage) == -1){
+        return -1;
+    }
+    if(logstore_stage_write(&conn->stage, conn->buffer, conn->totalBytesRecvd) == -1){
+        return -1;
+    }
+    conn->totalBytesRecvd = 0;
+    conn->scanned = 0;
+    return 0;
+}
+
+/**
+ * @brief Keep-alive: answers the next buffered packet, or waits for more bytes if none is complete
+ */
+static void uringConnNext(uring_loop_t *loop, uring_conn_t *conn)
+{
+    if(uringConnCursorLine(loop, conn)){
+        return;
+    }
+
+    size_t packetLen = framing_next_packet(conn->buffer, conn->totalBytesRecvd, &conn->scanned);
+    if(packetLen > 0){
+        if(uringPacketTooLarge(loop, conn, packetLen)){
+            uringConnClose(loop, conn);
+        } else {
+            uringConnAppend(loop, conn, packetLen, true);
+        }
+        return;
+    }
+
+    if(uringConnIngestPartial(loop, conn) == -1){
+        uringConnClose(loop, conn);
+        return;
+    }
+
+    if(conn->peerClosed){
+        // Whatever is left is the final (unterminated) packet
+        if(conn->totalBytesRecvd > 0 || conn->stage.len > 0){
+            uringConnAppend(loop, conn, conn->totalBytesRecvd, true);
+        } else {
+            uringConnClose(loop, conn);
+        }
+        return;
+    }
+
+    if(uringArmRecv(loop, conn) == -1){
+        uringConnClose(loop, conn);
+    }
+}
+
+/**
+ * @brief Without keep-alive: answers a buffered cursor line, or appends the buffered packets and replays once
+ *          they end on a packet boundary or at EOF (same framing as the other modes), or waits for more bytes
+ */
+static void uringConnFrame(uring_loop_t *loop, uring_conn_t *conn)
+{
+    if(uringConnCursorLine(loop, conn)){
+        return;
+    }
+
+    size_t packetLen;
+    while((packetLen = framing_next_packet(conn->buffer, conn->totalBytesRecvd, &conn->scanned)) > 0){
+        if(uringPacketTooLarge(loop, conn, packetLen)){
+            uringConnClose(loop, conn);
+            return;
+        }
+        if(packetLen == conn->totalBytesRecvd){
+            uringConnAppend(loop, conn, packetLen, true);
+            return;
+        }
+        uringConnAppend(loop, conn, packetLen, false);
+    }
+
+    if(uringConnIngestPartial(loop, conn) == -1){
+        uringConnClose(loop, conn);
+        return;
+    }
+
+    if(conn->peerClosed){
+        uringConnAppend(loop, conn, conn->totalBytesRecvd, true);
+    } else if(uringArmRecv(loop, conn) == -1){
+        uringConnClose(loop, conn);
+    }
+}
+
+/**
+ * @brief Picks up after a replay has been fully sent: the next packet (keep-alive or after a cursor line)
+ *          or teardown
+ */
+static void uringConnReplayDone(uring_loop_t *loop, uring_conn_t *conn)
+{
+    conn->cursor.offset = conn->replayEnd;
+    logstore_snapshot_release(&conn->snapshot); // Don't hold it while the connection idles
+    if(!conn->replayingCursorLine){
+        metrics_observe(METRIC_HIST_REPLAY, metrics_now_ns() - conn->packetNs);
+    }
+
+    if(loop->keepAlive && loop->draining && conn->totalBytesRecvd == 0 && conn->stage.len == 0){
+        uringConnClose(loop, conn); // Handing off: no waiting for another packet
+    } else if(loop->keepAlive){
+        uringConnNext(loop, conn);
+    } else if(conn->replayingCursorLine){
+        uringConnFrame(loop, conn); // The cursor line doesn't count as the connection's one packet
+    } else {
+        uringConnClose(loop, conn); // One packet per connection
+    }
+}
+
+/**
+ * @brief Starts sending log bytes [replayOffset, replayEnd), or moves on if there are none
+ */
+static void uringConnReplay(uring_loop_t *loop, uring_conn_t *conn)
+{
+    if(conn->replayOffset >= conn->replayEnd){
+        uringConnReplayDone(loop, conn);
+    } else if(uringArmSend(loop, conn) == -1){
+        uringConnClose(loop, conn);
+    }
+}
+
+static void uringHandleAccept(uring_loop_t *loop, struct io_uring_cqe *cqe)
+{
+    if(!(cqe->flags & IORING_CQE_F_MORE) && loop->draining){
+        loop->acceptEnded = true; // Connections accepted up to here are still served below
+    } else if(!(cqe->flags & IORING_CQE_F_MORE) && !loop->stopping){
+        // The multishot accept was terminated (e.g. ring overflow); re-arm it
+        uringArmAccept(loop);
+    }
+
+    if(cqe->res < 0){
+        if(cqe->res != -EINTR && cqe->res != -ECANCELED){
+            fprintf(stderr, "accept failed: %s\n", strerror(-cqe->res));
+        }
+        return;
+    }
+    metrics_add(METRIC_ACCEPTS, 1);
+
+    uring_conn_t *conn = calloc(1, sizeof(*conn));
+    if(conn == NULL){
+        printf("Failed to alloc connection in uringHandleAccept\n");
+        close(cqe->res);
+        metrics_add(METRIC_CLOSES, 1);
+        return;
+    }
+    conn->fd = cqe->res;
+    conn->stage.fd = -1;
+    loop->liveConns++;
+
+    if(uringArmRecv(loop, conn) == -1){
+        uringConnClose(loop, conn);
+    }
+}
+
+static void uringHandleRecv(uring_loop_t *loop, uring_conn_t *conn, struct io_uring_cqe *cqe)
+{
+    if(cqe->res == -ENOBUFS){
+        // All provided buffers are in flight; they are recycled as soon as they're copied, so just retry
+        if(uringArmRecv(loop, conn) == -1){
+            uringConnClose(loop, conn);
+        }
+        return;
+    }
+
+    if(cqe->res < 0){
+        if(cqe->res == -ECANCELED && loop->keepAlive){
+            DLOG(LOG_DEBUG, "Keep-alive connection idle - closing");
+        } else {
+            fprintf(stderr, "recv failed: %s\n", strerror(-cqe->res));
+        }
+        uringConnClose(loop, conn);
+        return;
+    }
+
+    metrics_add(METRIC_BYTES_IN, cqe->res);
+    if(cqe->flags & IORING_CQE_F_BUFFER){
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *data = loop->bufBase + (size_t) bid * URING_RECV_BUFFER_BYTES;
+        int rc = uringConnBuffer(conn, data, cqe->res);
+        uringRecycleBuffer(loop, bid);
+        if(rc == -1){
+            uringConnClose(loop, conn);
+            return;
+        }
+    }
+
+    conn->peerClosed = cqe->res == 0;
+    if(loop->keepAlive){
+        uringConnNext(loop, conn);
+    } else {
+        uringConnFrame(loop, conn);
+    }
+}
+
+static void uringHandleSend(uring_loop_t *loop, uring_conn_t *conn, struct io_uring_cqe *cqe)
+{
+    if(cqe->res <= 0){
+        if(cqe->res == -ECANCELED && loop->stallDeadline){
+            DLOG(LOG_DEBUG, "Client stalled replay for %lld s - dropping connection",
+                   (long long) loop->stallTimeout.tv_sec);
+        } else if(cqe->res < 0){
+            fprintf(stderr, "send: %s\n", strerror(-cqe->res));
+        }
+        uringConnClose(loop, conn);
+        return;
+    }
+    conn->replayOffset += cqe->res;
+    metrics_add(METRIC_BYTES_OUT, cqe->res);
+    if(conn->replayOffset < conn->replayEnd){
+        // Short send; continue from where the kernel stopped
+        if(uringArmSend(loop, conn) == -1){
+            uringConnClose(loop, conn);
+        }
+        return;
+    }
+
+    uringConnReplayDone(loop, conn);
+}
+
+/**
+ * @brief Cancels the multishot accept, so new clients wait in the listen backlog for the next process, and
+ *          arms the drain deadline. The loop stops once the accept has ended and every connection has closed.
+ */
+static void uringStartDrain(uring_loop_t *loop)
+{
+    loop->draining = true;
+    if(uringReserve(loop, 2) == -1){
+        loop->stopping = true; // Ring is wedged; drop the connections instead
+        return;
+    }
+    struct io_uring_sqe *cancel = uringGetSqe(loop);
+    struct io_uring_sqe *deadline = uringGetSqe(loop);
+    cancel->opcode = IORING_OP_ASYNC_CANCEL;
+    cancel->fd = -1;
+    cancel->addr = uringTag(NULL, URING_OP_ACCEPT);
+    cancel->user_data = uringTag(NULL, URING_OP_CLOSE);
+
+    deadline->opcode = IORING_OP_TIMEOUT;
+    deadline->fd = -1;
+    deadline->addr = (uintptr_t) &loop->drainTimeout;
+    deadline->len = 1;
+    deadline->user_data = uringTag(NULL, URING_OP_WAKE);
+}
+
+/**
+ * @brief Reaps every available completion
+ */
+static void uringReap(uring_loop_t *loop)
+{
+    unsigned head = *loop->cqHead;
+    unsigned tail = __atomic_load_n(loop->cqTail, __ATOMIC_ACQUIRE);
+
+    while(head != tail){
+        struct io_uring_cqe *cqe = &loop->cqes[head & loop->cqMask];
+        uring_conn_t *conn = (uring_conn_t *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+
+        switch(cqe->user_data & URING_OP_MASK){
+        case URING_OP_ACCEPT:
+            uringHandleAccept(loop, cqe);
+            break;
+        case URING_OP_WAKE:
+            // The drain deadline also completes as a wake
+            if(loop->draining || loop->drainOnStop == NULL || !*loop->drainOnStop){
+                loop->stopping = true;
+            } else {
+                uringStartDrain(loop);
+            }
+            break;
+        case URING_OP_TIMER:
+            timestamp_tick(loop->timestamps);
+            if(uringArmTimer(loop) == -1){
+                DLOG(LOG_ERR, "io_uring timestamp timer re-arm failed");
+            }
+            break;
+        case URING_OP_RECV:
+            uringHandleRecv(loop, conn, cqe);
+            break;
+        case URING_OP_SEND:
+            uringHandleSend(loop, conn, cqe);
+            break;
+        default:
+            break; // Teardown completions carry no state
+        }
+
+        head++;
+        if(head == tail){
+            tail = __atomic_load_n(loop->cqTail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    __atomic_store_n(loop->cqHead, head, __ATOMIC_RELEASE);
+}
+
+static void uringLoopDestroy(uring_loop_t *loop)
+{
+    if(loop->sqes != NULL && loop->sqes != MAP_FAILED){
+        munmap(loop->sqes, loop->sqesBytes);
+    }
+    if(loop->cqRingPtr != NULL && loop->cqRingPtr != MAP_FAILED && loop->cqRingPtr != loop->sqRingPtr){
+        munmap(loop->cqRingPtr, loop->cqRingBytes);
+    }
+    if(loop->sqRingPtr != NULL && loop->sqRingPtr != MAP_FAILED){
+        munmap(loop->sqRingPtr, loop->sqRingBytes);
+    }
+    if(loop->fd != -1){
+        close(loop->fd);
+    }
+    if(loop->bufRing != NULL && (void *) loop->bufRing != MAP_FAILED){
+        munmap(loop->bufRing, loop->bufRingBytes);
+    }
+    free(loop->bufBase);
+    free(loop);
+}
+
+/**
+ * @brief Creates a ring, maps it, registers the listener and the provided receive buffers
+ * @return The loop, or NULL with errno set if the kernel can't support this model.
+ */
+static uring_loop_t *uringLoopCreate(int listenfd, const uring_config_t *config)
+{
+    uring_loop_t *loop = calloc(1, sizeof(*loop));
+    if(loop == NULL){
+        return NULL;
+    }
+    loop->fd = -1;
+    loop->store = config->store;
+    loop->shutdownfd = config->shutdownfd;
+    loop->endProgram = config->endProgram;
+    loop->keepAlive = config->keepAliveIdleSec > 0;
+    loop->idleTimeout.tv_sec = config->keepAliveIdleSec;
+    loop->stallDeadline = config->stallDeadlineSec > 0;
+    loop->stallTimeout.tv_sec = config->stallDeadlineSec;
+    loop->spillThresholdBytes = config->spillThresholdBytes;
+    loop->maxPacketBytes = config->maxPacketBytes;
+    loop->drainOnStop = config->drainOnStop;
+    loop->drainTimeout.tv_sec = config->drainMs / 1000;
+    loop->drainTimeout.tv_nsec = (config->drainMs % 1000) * 1000000LL;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    loop->fd = uringSetup(URING_ENTRIES, &params);
+    if(loop->fd == -1){
+        goto fail;
+    }
+
+    loop->sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    loop->cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(loop->cqRingBytes > loop->sqRingBytes){
+            loop->sqRingBytes = loop->cqRingBytes;
+        }
+    }
+
+    loop->sqRingPtr = mmap(NULL, loop->sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           loop->fd, IORING_OFF_SQ_RING);
+    if(loop->sqRingPtr == MAP_FAILED){
+        goto fail;
+    }
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        loop->cqRingPtr = loop->sqRingPtr;
+    } else {
+        loop->cqRingPtr = mmap(NULL, loop->cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               loop->fd, IORING_OFF_CQ_RING);
+        if(loop->cqRingPtr == MAP_FAILED){
+            goto fail;
+        }
+    }
+
+    loop->sqesBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL, loop->sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      loop->fd, IORING_OFF_SQES);
+    if(loop->sqes == MAP_FAILED){
+        goto fail;
+    }
+
+    char *sq = loop->sqRingPtr;
+    loop->sqHead = (unsigned *) (sq + params.sq_off.head);
+    loop->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    loop->sqMask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    loop->sqArray = (unsigned *) (sq + params.sq_off.array);
+    loop->sqEntries = params.sq_entries;
+    loop->sqLocalTail = *loop->sqTail;
+
+    char *cq = loop->cqRingPtr;
+    loop->cqHead = (unsigned *) (cq + params.cq_off.head);
+    loop->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    loop->cqMask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // Ops this model depends on; all present from 5.11, multishot accept and buffer rings from 5.19
+    size_t probeBytes = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probeBytes);
+    if(probe == NULL){
+        goto fail;
+    }
+    if(uringRegister(loop->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == -1){
+        free(probe);
+        goto fail;
+    }
+    const uint8_t requiredOps[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_POLL_ADD,
+                                   IORING_OP_SHUTDOWN, IORING_OP_CLOSE, IORING_OP_LINK_TIMEOUT,
+                                   IORING_OP_ASYNC_CANCEL, IORING_OP_TIMEOUT};
+    for(size_t i = 0; i < sizeof(requiredOps); i++){
+        uint8_t op = requiredOps[i];
+        if(op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)){
+            free(probe);
+            errno = EOPNOTSUPP;
+            goto fail;
+        }
+    }
+    free(probe);
+
+    // The listener is a registered (fixed) file, so accepts skip the fd table lookup
+    if(uringRegister(loop->fd, IORING_REGISTER_FILES, &listenfd, 1) == -1){
+        goto fail;
+    }
+
+    loop->bufRingBytes = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+    loop->bufRing = mmap(NULL, loop->bufRingBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if((void *) loop->bufRing == MAP_FAILED){
+        goto fail;
+    }
+    loop->bufBase = malloc((size_t) URING_RECV_BUFFERS * URING_RECV_BUFFER_BYTES);
+    if(loop->bufBase == NULL){
+        goto fail;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t) loop->bufRing;
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if(uringRegister(loop->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1){
+        goto fail;
+    }
+    for(unsigned short bid = 0; bid < URING_RECV_BUFFERS; bid++){
+        uringRecycleBuffer(loop, bid);
+    }
+
+    return loop;
+
+fail:
+    {
+        int savedErrno = errno;
+        uringLoopDestroy(loop);
+        errno = savedErrno;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs one ring until shutdown
+ */
+static void uringLoopRun(uring_loop_t *loop)
+{
+    if(uringArmAccept(loop) == -1 || uringArmWake(loop) == -1 ||
+       (loop->timestamps != NULL && uringArmTimer(loop) == -1)){
+        return;
+    }
+
+    while(!loop->stopping && !(loop->draining && loop->acceptEnded && loop->liveConns == 0))
+    {
+        // Submit everything queued by the last batch of completions and wait for at least one more
+        if(uringSubmit(loop, 1) == -1){
+            if(errno == EINTR){
+                if(*loop->endProgram){
+                    break;
+                }
+                continue;
+            }
+            perror("io_uring_enter");
+            break;
+        }
+
+        uringReap(loop);
+    }
+
+    if(loop->draining){
+        uringSubmit(loop, 0); // Send the teardown of the last drained connections on its way
+    }
+}
+
+static void* uringLoopThread(void* arg)
+{
+    uring_loop_t *loop = arg;
+    uringLoopRun(loop);
+    return NULL;
+}
+
+/**
+ * @brief Pins thread to CPU index modulo the online CPU count
+ */
+static void uringPinThread(pthread_t thread, int index)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % (cpus > 0 ? cpus : 1), &set);
+    int rc = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if(rc != 0){
+        fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(rc));
+    }
+}
+
+int uring_serve(const uring_config_t *config)
+{
+    const int *listenfds = config->listenfds;
+    int numListenfds = config->numListenfds;
+    int numRings = config->numRings;
+    bool pinRings = config->pinRings;
+    if(numRings > URING_MAX_RINGS){
+        numRings = URING_MAX_RINGS;
+    }
+
+    // Ring 0 is created up front; if that fails the kernel can't run this model and the caller falls back
+    uring_loop_t *loops[URING_MAX_RINGS];
+    loops[0] = uringLoopCreate(listenfds[0], config);
+    if(loops[0] == NULL){
+        DLOG(LOG_DEBUG, "io_uring unavailable: %s", strerror(errno));
+        return URING_UNSUPPORTED;
+    }
+    if(config->timestamps != NULL && timestamp_fd(config->timestamps) != -1){
+        loops[0]->timestamps = config->timestamps;
+    }
+
+    pthread_t threads[URING_MAX_RINGS];
+    int started = 1;
+    for(int i = 1; i < numRings; i++){
+        loops[started] = uringLoopCreate(listenfds[i % numListenfds], config);
+        if(loops[started] == NULL){
+            perror("io_uring ring create");
+            break;
+        }
+        if(pthread_create(&threads[started], NULL, uringLoopThread, loops[started]) != 0){
+            perror("pthread_create io_uring loop");
+            uringLoopDestroy(loops[started]);
+            break;
+        }
+        if(pinRings){
+            uringPinThread(threads[started], i);
+        }
+        started++;
+    }
+
+    DLOG(LOG_DEBUG, "Serving with %d io_uring loops on %d listeners", started, numListenfds);
+    if(pinRings){
+        uringPinThread(pthread_self(), 0);
+    }
+    uringLoopRun(loops[0]);
+
+    for(int i = 1; i < started; i++){
+        pthread_join(threads[i], NULL);
+    }
+    // Closing a ring cancels its outstanding requests; connections still open at shutdown are dropped
+    for(int i = 0; i < started; i++){
+        uringLoopDestroy(loops[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * uring.h
+ *
+ * io_uring serving model for aesdsocket (-m uring, built with USE_IO_URING=1).
+ *
+ * Each ring thread keeps a multishot accept armed on the registered listening
+ * socket, receives into a ring of kernel-provided buffers, appends complete
+ * packets to the log store and sends the replay straight from the log mapping.
+ * With keep-alive each recv carries a linked timeout that ends idle connections;
+ * each send carries one that drops clients which stop reading.
+ * Ring 0 also keeps a poll armed on the timestamp timerfd. To hand off to a
+ * new process, rings cancel their accept and drain their open connections
+ * before returning.
+ * Connection teardown is a linked shutdown + close. Everything a loop
+ * iteration produces goes to the kernel in a single io_uring_enter().
+ *
+ * Talks to the kernel through the raw io_uring syscalls and uapi header, so no
+ * liburing is needed on the target.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include "logstore.h"
+#include "timestamp.h"
+
+/**
+ * Returned by uring_serve() when the running kernel lacks a required io_uring feature.
+ * Nothing has been accepted yet, so the caller can fall back to another serving model.
+ */
+#define URING_UNSUPPORTED (-2)
+
+typedef struct uring_config_s {
+    const int *listenfds;
+    int numListenfds;
+    int numRings;
+    bool pinRings;          // Pin ring i's thread to CPU i
+    logstore_t *store;
+    int shutdownfd;
+    volatile int *endProgram;
+    int keepAliveIdleSec;   // 0 serves one packet per connection; otherwise close after this long idle
+    size_t spillThresholdBytes; // Partial packets this big move from memory to a logstore stage
+    size_t maxPacketBytes;      // Connections sending a bigger packet are dropped
+    int stallDeadlineSec;       // Drop clients whose replay makes no progress this long; 0 never
+    timestamp_writer_t *timestamps; // Ring 0 polls its timerfd and ticks it; NULL for none
+    volatile int *drainOnStop;  // Non-zero when shutdownfd fires: stop accepting, finish open connections
+                                // (within drainMs), then return
+    int drainMs;
+} uring_config_t;
+
+/**
+ * @brief Serves connections with config->numRings io_uring loops (the caller runs loop 0) until
+ *          *endProgram is set and shutdownfd becomes readable. Ring i accepts on listenfds[i % numListenfds].
+ * @return 0 on clean shutdown, -1 on failure, URING_UNSUPPORTED if io_uring can't be used here.
+ */
+int uring_serve(const uring_config_t *config);
+
+#endif /* URING_H */
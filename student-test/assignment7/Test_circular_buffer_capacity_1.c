@@ -0,0 +1,17 @@
+#undef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED // Even if the build overrides it
+#define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 1
+#define AESD_CB_TEST_RENAME(name) name##_capacity_1
+#include "circular-buffer-at-capacity.h"
+
+/**
+ * With one entry every add evicts the previous one
+ */
+void test_circular_buffer_capacity_1_add_and_find()
+{
+    capacityTestAddAndFind();
+}
+
+void test_circular_buffer_capacity_1_cursor()
+{
+    capacityTestCursor();
+}
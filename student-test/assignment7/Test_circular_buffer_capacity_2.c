@@ -0,0 +1,17 @@
+#undef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED // Even if the build overrides it
+#define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 2
+#define AESD_CB_TEST_RENAME(name) name##_capacity_2
+#include "circular-buffer-at-capacity.h"
+
+/**
+ * The smallest capacity where in_offs and out_offs can differ
+ */
+void test_circular_buffer_capacity_2_add_and_find()
+{
+    capacityTestAddAndFind();
+}
+
+void test_circular_buffer_capacity_2_cursor()
+{
+    capacityTestCursor();
+}
@@ -0,0 +1,163 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+#define CURSOR_TEST_CAPACITY AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+/**
+ * Text of the entry added k-th (counting from 1); lengths vary so entry boundaries move around
+ */
+static const char *cursorTestText(unsigned k)
+{
+    static char texts[4 * CURSOR_TEST_CAPACITY + 1][24];
+    snprintf(texts[k], sizeof(texts[k]), "write%u%.*s\n", k, (int) (k % 3), "xx");
+    return texts[k];
+}
+
+/**
+ * Adds entries first..last (inclusive) to buffer
+ */
+static void cursorTestAdd(struct aesd_circular_buffer *buffer, unsigned first, unsigned last)
+{
+    for(unsigned k = first; k <= last; k++){
+        struct aesd_buffer_entry entry = {.buffptr = cursorTestText(k), .size = strlen(cursorTestText(k))};
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+/**
+ * Reads buffer through a cursor from its oldest byte, a few bytes at a time, into out
+ * @return bytes read
+ */
+static size_t cursorTestRead(struct aesd_circular_buffer *buffer, char *out, size_t step)
+{
+    struct aesd_circular_buffer_cursor cursor;
+    aesd_circular_buffer_cursor_init(buffer, &cursor);
+
+    size_t total = 0;
+    size_t entryOffset;
+    struct aesd_buffer_entry *entry;
+    while((entry = aesd_circular_buffer_cursor_entry(buffer, &cursor, &entryOffset)) != NULL){
+        size_t n = entry->size - entryOffset < step ? entry->size - entryOffset : step;
+        memcpy(out + total, entry->buffptr + entryOffset, n);
+        total += n;
+        aesd_circular_buffer_cursor_advance(buffer, &cursor, n);
+    }
+    return total;
+}
+
+/**
+ * A cursor seeked to any offset lands on the entry and byte that aesd_circular_buffer_find_entry_offset_for_fpos()
+ * finds; seeking just past the end waits for the next entry, and seeking further fails.
+ */
+void test_circular_buffer_cursor_seek()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    cursorTestAdd(&buffer, 1, CURSOR_TEST_CAPACITY + 3); // Wrapped, so offsets start at the oldest entry held
+
+    size_t held = buffer.end_pos - buffer.entry_start[buffer.out_offs];
+    for(size_t offset = 0; offset < held; offset++){
+        struct aesd_circular_buffer_cursor cursor;
+        TEST_ASSERT_TRUE_MESSAGE(aesd_circular_buffer_cursor_seek(&buffer, &cursor, offset),
+                                 "Seek within the buffer failed");
+
+        size_t expectedByte, cursorByte;
+        struct aesd_buffer_entry *expected = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offset,
+                                                                                             &expectedByte);
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_cursor_entry(&buffer, &cursor, &cursorByte);
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(expected, entry, "Seeked cursor is in the wrong entry");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(expectedByte, cursorByte, "Seeked cursor is at the wrong byte");
+    }
+
+    struct aesd_circular_buffer_cursor cursor;
+    size_t entryOffset;
+    TEST_ASSERT_TRUE_MESSAGE(aesd_circular_buffer_cursor_seek(&buffer, &cursor, held),
+                             "Seek just past the last byte should succeed");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_cursor_entry(&buffer, &cursor, &entryOffset),
+                             "A cursor past the last byte should have no entry");
+
+    struct aesd_circular_buffer_cursor unchanged = cursor;
+    TEST_ASSERT_FALSE_MESSAGE(aesd_circular_buffer_cursor_seek(&buffer, &cursor, held + 1),
+                              "Seek beyond the data should fail");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(&unchanged, &cursor, sizeof(cursor), "A failed seek moved the cursor");
+
+    // The waiting cursor picks up the next entry at its first byte
+    cursorTestAdd(&buffer, CURSOR_TEST_CAPACITY + 4, CURSOR_TEST_CAPACITY + 4);
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_cursor_entry(&buffer, &cursor, &entryOffset);
+    TEST_ASSERT_NOT_NULL_MESSAGE(entry, "A waiting cursor did not see the entry added after it");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(cursorTestText(CURSOR_TEST_CAPACITY + 4), entry->buffptr,
+                                     "A waiting cursor is in the wrong entry");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, entryOffset, "A waiting cursor should start at the first byte");
+}
+
+/**
+ * Advancing a cursor in steps that straddle entry boundaries, across the point where the entry array wraps,
+ * reads exactly the entries held, oldest first. An empty entry in the middle is skipped.
+ */
+void test_circular_buffer_cursor_advance_across_wrap()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    cursorTestAdd(&buffer, 1, CURSOR_TEST_CAPACITY / 2 + 1);
+    struct aesd_buffer_entry empty = {.buffptr = "", .size = 0};
+    aesd_circular_buffer_add_entry(&buffer, &empty);
+    cursorTestAdd(&buffer, CURSOR_TEST_CAPACITY / 2 + 2, CURSOR_TEST_CAPACITY + 2);
+    TEST_ASSERT_TRUE_MESSAGE(buffer.out_offs > 0, "The buffer should have wrapped");
+
+    // Three entries more than fit: the first three were evicted
+    char expected[4 * CURSOR_TEST_CAPACITY * 24] = "";
+    for(unsigned k = 4; k <= CURSOR_TEST_CAPACITY + 2; k++){
+        strcat(expected, cursorTestText(k));
+    }
+
+    for(size_t step = 1; step <= 16; step++){
+        char out[sizeof(expected)] = "";
+        size_t total = cursorTestRead(&buffer, out, step);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(strlen(expected), total, "Cursor read the wrong number of bytes");
+        TEST_ASSERT_EQUAL_STRING_MESSAGE(expected, out, "Cursor read the wrong bytes");
+    }
+}
+
+/**
+ * A cursor reports being overwritten once the entry it is in has been evicted, and not before
+ */
+void test_circular_buffer_cursor_overwritten()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    cursorTestAdd(&buffer, 1, CURSOR_TEST_CAPACITY);
+
+    struct aesd_circular_buffer_cursor oldest, newest;
+    aesd_circular_buffer_cursor_init(&buffer, &oldest);
+    size_t held = buffer.end_pos - buffer.entry_start[buffer.out_offs];
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_seek(&buffer, &newest, held - 1));
+    TEST_ASSERT_FALSE_MESSAGE(aesd_circular_buffer_cursor_overwritten(&buffer, &oldest),
+                              "A cursor in the oldest entry of a full buffer is still valid");
+
+    // One more entry evicts the oldest
+    cursorTestAdd(&buffer, CURSOR_TEST_CAPACITY + 1, CURSOR_TEST_CAPACITY + 1);
+    size_t entryOffset;
+    TEST_ASSERT_TRUE_MESSAGE(aesd_circular_buffer_cursor_overwritten(&buffer, &oldest),
+                             "Eviction of the cursor's entry was not detected");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_cursor_entry(&buffer, &oldest, &entryOffset),
+                             "An overwritten cursor should have no entry");
+
+    // The newest entry survives CURSOR_TEST_CAPACITY - 1 more adds, but not one beyond
+    cursorTestAdd(&buffer, CURSOR_TEST_CAPACITY + 2, 2 * CURSOR_TEST_CAPACITY - 1);
+    TEST_ASSERT_FALSE_MESSAGE(aesd_circular_buffer_cursor_overwritten(&buffer, &newest),
+                              "A cursor in an entry still held was reported overwritten");
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_cursor_entry(&buffer, &newest, &entryOffset);
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_STRING(cursorTestText(CURSOR_TEST_CAPACITY), entry->buffptr);
+
+    cursorTestAdd(&buffer, 2 * CURSOR_TEST_CAPACITY, 2 * CURSOR_TEST_CAPACITY);
+    TEST_ASSERT_TRUE_MESSAGE(aesd_circular_buffer_cursor_overwritten(&buffer, &newest),
+                             "Eviction of the cursor's entry was not detected");
+
+    // Seeking again recovers the cursor
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_seek(&buffer, &newest, 0));
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_overwritten(&buffer, &newest));
+}
@@ -0,0 +1,112 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+ * @return number of chunks slab has allocated. The chunk type is private to aesd-circular-buffer.c; chunks
+ *      are linked through their first member.
+ */
+static size_t slabTestChunks(const struct aesd_circular_buffer_slab *slab)
+{
+    size_t chunks = 0;
+    for(const void *chunk = slab->chunks; chunk != NULL; chunk = *(const void *const *) chunk){
+        chunks++;
+    }
+    return chunks;
+}
+
+/**
+ * A freed buffer is handed out again, initialized as if new
+ */
+void test_circular_buffer_slab_reuse()
+{
+    struct aesd_circular_buffer_slab slab;
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_slab_init(&slab));
+
+    struct aesd_circular_buffer *buffer = aesd_circular_buffer_alloc(&slab);
+    TEST_ASSERT_NOT_NULL(buffer);
+    for(int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1; i++){
+        struct aesd_buffer_entry entry = {.buffptr = "used\n", .size = 5};
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    aesd_circular_buffer_free(&slab, buffer);
+
+    struct aesd_circular_buffer *again = aesd_circular_buffer_alloc(&slab);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(buffer, again, "A freed buffer was not reused");
+    struct aesd_circular_buffer empty;
+    aesd_circular_buffer_init(&empty);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(&empty, again, sizeof(empty), "A reused buffer was not reinitialized");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, slabTestChunks(&slab), "Reuse should not allocate another chunk");
+
+    aesd_circular_buffer_free(&slab, again);
+    aesd_circular_buffer_slab_destroy(&slab);
+}
+
+/**
+ * Allocating more buffers than one chunk holds adds a chunk; every buffer is distinct and usable, and once
+ * they are all freed they satisfy the same number of allocations again without growing
+ */
+void test_circular_buffer_slab_growth()
+{
+    struct aesd_circular_buffer_slab slab;
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_slab_init(&slab));
+
+    size_t count = slab.chunk_buffers + 1;
+    struct aesd_circular_buffer **buffers = calloc(count, sizeof(*buffers));
+    TEST_ASSERT_NOT_NULL(buffers);
+    for(size_t i = 0; i < count; i++){
+        buffers[i] = aesd_circular_buffer_alloc(&slab);
+        TEST_ASSERT_NOT_NULL(buffers[i]);
+        // Stamp each buffer; an overlapping one would clobber a neighbour's stamp
+        buffers[i]->end_pos = i;
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, slabTestChunks(&slab), "One buffer past a chunk should add one chunk");
+    for(size_t i = 0; i < count; i++){
+        TEST_ASSERT_EQUAL_INT_MESSAGE(i, buffers[i]->end_pos, "Buffers handed out overlap");
+    }
+
+    for(size_t i = 0; i < count; i++){
+        aesd_circular_buffer_free(&slab, buffers[i]);
+    }
+    for(size_t i = 0; i < count; i++){
+        buffers[i] = aesd_circular_buffer_alloc(&slab);
+        TEST_ASSERT_NOT_NULL(buffers[i]);
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, slabTestChunks(&slab), "Freed buffers should be reused before growing");
+
+    for(size_t i = 0; i < count; i++){
+        aesd_circular_buffer_free(&slab, buffers[i]);
+    }
+    free(buffers);
+    aesd_circular_buffer_slab_destroy(&slab);
+}
+
+/**
+ * Destroying a slab with buffers still allocated releases their memory along with the rest, and the slab can
+ * be set up again afterwards
+ */
+void test_circular_buffer_slab_destroy_outstanding()
+{
+    struct aesd_circular_buffer_slab slab;
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_slab_init(&slab));
+
+    size_t count = slab.chunk_buffers + 2;
+    for(size_t i = 0; i < count; i++){
+        struct aesd_circular_buffer *buffer = aesd_circular_buffer_alloc(&slab);
+        TEST_ASSERT_NOT_NULL(buffer);
+        if(i % 2 == 0){
+            aesd_circular_buffer_free(&slab, buffer); // Leave a mix of free and outstanding buffers
+        }
+    }
+    aesd_circular_buffer_slab_destroy(&slab);
+    TEST_ASSERT_NULL_MESSAGE(slab.chunks, "Destroy left chunks behind");
+    TEST_ASSERT_NULL_MESSAGE(slab.free_list, "Destroy left a free list behind");
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_slab_init(&slab));
+    struct aesd_circular_buffer *buffer = aesd_circular_buffer_alloc(&slab);
+    TEST_ASSERT_NOT_NULL_MESSAGE(buffer, "A slab set up again after destroy should allocate");
+    aesd_circular_buffer_free(&slab, buffer);
+    aesd_circular_buffer_slab_destroy(&slab);
+}
@@ -0,0 +1,128 @@
+/*
+ * circular-buffer-at-capacity.h
+ *
+ * The buffer's capacity is fixed when aesd-circular-buffer.c is compiled, and
+ * the autotest links it once at the default. A test file for another capacity
+ * defines AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED and
+ * AESD_CB_TEST_RENAME(name) (appending a suffix to name), then includes this
+ * header. That compiles a private copy of the buffer at that capacity, under
+ * renamed symbols, along with checks the test file runs against it.
+ */
+
+#ifndef CIRCULAR_BUFFER_AT_CAPACITY_H
+#define CIRCULAR_BUFFER_AT_CAPACITY_H
+
+#if !defined(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) || !defined(AESD_CB_TEST_RENAME)
+#error "Define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED and AESD_CB_TEST_RENAME before including this header"
+#endif
+
+#include "unity.h"
+#include <stdio.h>
+#include <string.h>
+
+#define aesd_circular_buffer_find_entry_offset_for_fpos \
+    AESD_CB_TEST_RENAME(aesd_circular_buffer_find_entry_offset_for_fpos)
+#define aesd_circular_buffer_add_entry AESD_CB_TEST_RENAME(aesd_circular_buffer_add_entry)
+#define aesd_circular_buffer_init AESD_CB_TEST_RENAME(aesd_circular_buffer_init)
+#define aesd_circular_buffer_cursor_init AESD_CB_TEST_RENAME(aesd_circular_buffer_cursor_init)
+#define aesd_circular_buffer_cursor_seek AESD_CB_TEST_RENAME(aesd_circular_buffer_cursor_seek)
+#define aesd_circular_buffer_cursor_entry AESD_CB_TEST_RENAME(aesd_circular_buffer_cursor_entry)
+#define aesd_circular_buffer_cursor_advance AESD_CB_TEST_RENAME(aesd_circular_buffer_cursor_advance)
+#define aesd_circular_buffer_cursor_overwritten AESD_CB_TEST_RENAME(aesd_circular_buffer_cursor_overwritten)
+#define aesd_circular_buffer_slab_init AESD_CB_TEST_RENAME(aesd_circular_buffer_slab_init)
+#define aesd_circular_buffer_slab_destroy AESD_CB_TEST_RENAME(aesd_circular_buffer_slab_destroy)
+#define aesd_circular_buffer_alloc AESD_CB_TEST_RENAME(aesd_circular_buffer_alloc)
+#define aesd_circular_buffer_free AESD_CB_TEST_RENAME(aesd_circular_buffer_free)
+#define aesd_circular_buffer_trace_hook AESD_CB_TEST_RENAME(aesd_circular_buffer_trace_hook)
+
+#include "../../aesd-char-driver/aesd-circular-buffer.c"
+
+/**
+ * Text of the entry added k-th (counting from 1)
+ */
+static const char *capacityTestText(unsigned k)
+{
+    static char texts[8 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1][16];
+    snprintf(texts[k], sizeof(texts[k]), "entry%u\n", k);
+    return texts[k];
+}
+
+/**
+ * Adds entries one at a time past several wraps, checking after each that the buffer holds exactly the
+ * newest ones, findable at every byte, and reports full once it has wrapped
+ */
+static void capacityTestAddAndFind(void)
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+
+    for(unsigned k = 1; k <= 4 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; k++){
+        struct aesd_buffer_entry add = {.buffptr = capacityTestText(k), .size = strlen(capacityTestText(k))};
+        aesd_circular_buffer_add_entry(&buffer, &add);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(k >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, buffer.full,
+                                      "Buffer full flag is wrong");
+
+        unsigned oldest = k > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ? k - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1 : 1;
+        size_t offset = 0;
+        for(unsigned held = oldest; held <= k; held++){
+            for(size_t byte = 0; byte < strlen(capacityTestText(held)); byte++, offset++){
+                size_t entryOffset;
+                struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offset,
+                                                                                                  &entryOffset);
+                TEST_ASSERT_NOT_NULL_MESSAGE(entry, "Byte held in the buffer was not found");
+                TEST_ASSERT_EQUAL_STRING_MESSAGE(capacityTestText(held), entry->buffptr, "Found the wrong entry");
+                TEST_ASSERT_EQUAL_INT_MESSAGE(byte, entryOffset, "Found the wrong byte");
+            }
+        }
+        size_t entryOffset;
+        TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offset, &entryOffset),
+                                 "Found a byte past the end of the buffer");
+    }
+}
+
+/**
+ * Reads the buffer through a cursor after it has wrapped, and checks the cursor is overwritten exactly when
+ * its entry is evicted
+ */
+static void capacityTestCursor(void)
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    unsigned last = 2 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1;
+    for(unsigned k = 1; k <= last; k++){
+        struct aesd_buffer_entry add = {.buffptr = capacityTestText(k), .size = strlen(capacityTestText(k))};
+        aesd_circular_buffer_add_entry(&buffer, &add);
+    }
+
+    char expected[8 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * 16] = "";
+    for(unsigned k = last - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1; k <= last; k++){
+        strcat(expected, capacityTestText(k));
+    }
+
+    struct aesd_circular_buffer_cursor cursor;
+    aesd_circular_buffer_cursor_init(&buffer, &cursor);
+    char out[sizeof(expected)] = "";
+    size_t total = 0;
+    size_t entryOffset;
+    struct aesd_buffer_entry *entry;
+    while((entry = aesd_circular_buffer_cursor_entry(&buffer, &cursor, &entryOffset)) != NULL){
+        // Three bytes at a time, so reads straddle entries
+        size_t n = entry->size - entryOffset < 3 ? entry->size - entryOffset : 3;
+        memcpy(out + total, entry->buffptr + entryOffset, n);
+        total += n;
+        aesd_circular_buffer_cursor_advance(&buffer, &cursor, n);
+    }
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(expected, out, "Cursor read the wrong bytes");
+
+    aesd_circular_buffer_cursor_init(&buffer, &cursor);
+    struct aesd_buffer_entry add = {.buffptr = capacityTestText(last + 1), .size = strlen(capacityTestText(last + 1))};
+    aesd_circular_buffer_add_entry(&buffer, &add);
+    TEST_ASSERT_TRUE_MESSAGE(aesd_circular_buffer_cursor_overwritten(&buffer, &cursor),
+                             "Eviction of the cursor's entry was not detected");
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_seek(&buffer, &cursor, 0));
+    entry = aesd_circular_buffer_cursor_entry(&buffer, &cursor, &entryOffset);
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_STRING(capacityTestText(last - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 2), entry->buffptr);
+}
+
+#endif /* CIRCULAR_BUFFER_AT_CAPACITY_H */